@@ -150,14 +150,15 @@ BEGIN_RCPP
 END_RCPP
 }
 // encode_data
-SEXP encode_data(const std::string& path, double progress);
-RcppExport SEXP BWPMF_encode_data(SEXP pathSEXP, SEXP progressSEXP) {
+SEXP encode_data(const std::string& path, double progress, bool item_index);
+RcppExport SEXP BWPMF_encode_data(SEXP pathSEXP, SEXP progressSEXP, SEXP item_indexSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
     Rcpp::traits::input_parameter< double >::type progress(progressSEXP);
-    __result = Rcpp::wrap(encode_data(path, progress));
+    Rcpp::traits::input_parameter< bool >::type item_index(item_indexSEXP);
+    __result = Rcpp::wrap(encode_data(path, progress, item_index));
     return __result;
 END_RCPP
 }
@@ -174,24 +175,59 @@ BEGIN_RCPP
 END_RCPP
 }
 // deserialize_history_raw
-SEXP deserialize_history_raw(RawVector src);
-RcppExport SEXP BWPMF_deserialize_history_raw(SEXP srcSEXP) {
+SEXP deserialize_history_raw(RawVector src, bool item_index);
+RcppExport SEXP BWPMF_deserialize_history_raw(SEXP srcSEXP, SEXP item_indexSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< RawVector >::type src(srcSEXP);
-    __result = Rcpp::wrap(deserialize_history_raw(src));
+    Rcpp::traits::input_parameter< bool >::type item_index(item_indexSEXP);
+    __result = Rcpp::wrap(deserialize_history_raw(src, item_index));
     return __result;
 END_RCPP
 }
 // deserialize_history_path
-SEXP deserialize_history_path(const std::string& path);
-RcppExport SEXP BWPMF_deserialize_history_path(SEXP pathSEXP) {
+SEXP deserialize_history_path(const std::string& path, bool item_index);
+RcppExport SEXP BWPMF_deserialize_history_path(SEXP pathSEXP, SEXP item_indexSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
-    __result = Rcpp::wrap(deserialize_history_path(path));
+    Rcpp::traits::input_parameter< bool >::type item_index(item_indexSEXP);
+    __result = Rcpp::wrap(deserialize_history_path(path, item_index));
+    return __result;
+END_RCPP
+}
+// build_item_index
+void build_item_index(SEXP Rhistory);
+RcppExport SEXP BWPMF_build_item_index(SEXP RhistorySEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    build_item_index(Rhistory);
+    return R_NilValue;
+END_RCPP
+}
+// has_item_index
+bool has_item_index(SEXP Rhistory);
+RcppExport SEXP BWPMF_has_item_index(SEXP RhistorySEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    __result = Rcpp::wrap(has_item_index(Rhistory));
+    return __result;
+END_RCPP
+}
+// query_item_history
+DataFrame query_item_history(SEXP Rhistory, size_t item);
+RcppExport SEXP BWPMF_query_item_history(SEXP RhistorySEXP, SEXP itemSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< size_t >::type item(itemSEXP);
+    __result = Rcpp::wrap(query_item_history(Rhistory, item));
     return __result;
 END_RCPP
 }
@@ -261,6 +297,90 @@ BEGIN_RCPP
     return __result;
 END_RCPP
 }
+// order_history
+List order_history(SEXP Rhistory, const std::string& method);
+RcppExport SEXP BWPMF_order_history(SEXP RhistorySEXP, SEXP methodSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type method(methodSEXP);
+    __result = Rcpp::wrap(order_history(Rhistory, method));
+    return __result;
+END_RCPP
+}
+// permute_history
+SEXP permute_history(SEXP Rhistory, NumericVector user, NumericVector item);
+RcppExport SEXP BWPMF_permute_history(SEXP RhistorySEXP, SEXP userSEXP, SEXP itemSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type user(userSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type item(itemSEXP);
+    __result = Rcpp::wrap(permute_history(Rhistory, user, item));
+    return __result;
+END_RCPP
+}
+// permute_dictionary
+void permute_dictionary(NumericVector user, NumericVector item);
+RcppExport SEXP BWPMF_permute_dictionary(SEXP userSEXP, SEXP itemSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< NumericVector >::type user(userSEXP);
+    Rcpp::traits::input_parameter< NumericVector >::type item(itemSEXP);
+    permute_dictionary(user, item);
+    return R_NilValue;
+END_RCPP
+}
+// svi_train
+DataFrame svi_train(SEXP Rmodel, SEXP Rhistory, int batch_size, int steps, double tau0, double kappa, int local_iterations, double seed);
+RcppExport SEXP BWPMF_svi_train(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP batch_sizeSEXP, SEXP stepsSEXP, SEXP tau0SEXP, SEXP kappaSEXP, SEXP local_iterationsSEXP, SEXP seedSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type steps(stepsSEXP);
+    Rcpp::traits::input_parameter< double >::type tau0(tau0SEXP);
+    Rcpp::traits::input_parameter< double >::type kappa(kappaSEXP);
+    Rcpp::traits::input_parameter< int >::type local_iterations(local_iterationsSEXP);
+    Rcpp::traits::input_parameter< double >::type seed(seedSEXP);
+    __result = Rcpp::wrap(svi_train(Rmodel, Rhistory, batch_size, steps, tau0, kappa, local_iterations, seed));
+    return __result;
+END_RCPP
+}
+// svi_stream
+DataFrame svi_stream(SEXP Rmodel, const std::string& path, int batch_size, int epochs, double tau0, double kappa, int local_iterations);
+RcppExport SEXP BWPMF_svi_stream(SEXP RmodelSEXP, SEXP pathSEXP, SEXP batch_sizeSEXP, SEXP epochsSEXP, SEXP tau0SEXP, SEXP kappaSEXP, SEXP local_iterationsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type path(pathSEXP);
+    Rcpp::traits::input_parameter< int >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type epochs(epochsSEXP);
+    Rcpp::traits::input_parameter< double >::type tau0(tau0SEXP);
+    Rcpp::traits::input_parameter< double >::type kappa(kappaSEXP);
+    Rcpp::traits::input_parameter< int >::type local_iterations(local_iterationsSEXP);
+    __result = Rcpp::wrap(svi_stream(Rmodel, path, batch_size, epochs, tau0, kappa, local_iterations));
+    return __result;
+END_RCPP
+}
+// fold_in
+SEXP fold_in(SEXP Rmodel, SEXP Rhistory, int iterations);
+RcppExport SEXP BWPMF_fold_in(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP iterationsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< int >::type iterations(iterationsSEXP);
+    __result = Rcpp::wrap(fold_in(Rmodel, Rhistory, iterations));
+    return __result;
+END_RCPP
+}
 // test_list_of_list
 void test_list_of_list();
 RcppExport SEXP BWPMF_test_list_of_list() {
@@ -327,32 +447,86 @@ BEGIN_RCPP
 END_RCPP
 }
 // init_phi
-SEXP init_phi(SEXP Rmodel, SEXP Rhistory, const std::string& cached_file, int cache_size);
-RcppExport SEXP BWPMF_init_phi(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP cached_fileSEXP, SEXP cache_sizeSEXP) {
+SEXP init_phi(SEXP Rmodel, SEXP Rhistory, const std::string& cached_file, double cache_bytes, const std::string& storage, int cache_buffers, const std::string& codec, int top_m, double mass);
+RcppExport SEXP BWPMF_init_phi(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP cached_fileSEXP, SEXP cache_bytesSEXP, SEXP storageSEXP, SEXP cache_buffersSEXP, SEXP codecSEXP, SEXP top_mSEXP, SEXP massSEXP) {
 BEGIN_RCPP
     Rcpp::RObject __result;
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
     Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
     Rcpp::traits::input_parameter< const std::string& >::type cached_file(cached_fileSEXP);
-    Rcpp::traits::input_parameter< int >::type cache_size(cache_sizeSEXP);
-    __result = Rcpp::wrap(init_phi(Rmodel, Rhistory, cached_file, cache_size));
+    Rcpp::traits::input_parameter< double >::type cache_bytes(cache_bytesSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type storage(storageSEXP);
+    Rcpp::traits::input_parameter< int >::type cache_buffers(cache_buffersSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type codec(codecSEXP);
+    Rcpp::traits::input_parameter< int >::type top_m(top_mSEXP);
+    Rcpp::traits::input_parameter< double >::type mass(massSEXP);
+    __result = Rcpp::wrap(init_phi(Rmodel, Rhistory, cached_file, cache_bytes, storage, cache_buffers, codec, top_m, mass));
+    return __result;
+END_RCPP
+}
+// phi_disk_stats
+DataFrame phi_disk_stats(SEXP Rphi, bool reset);
+RcppExport SEXP BWPMF_phi_disk_stats(SEXP RphiSEXP, SEXP resetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rphi(RphiSEXP);
+    Rcpp::traits::input_parameter< bool >::type reset(resetSEXP);
+    __result = Rcpp::wrap(phi_disk_stats(Rphi, reset));
     return __result;
 END_RCPP
 }
 // train_once
-void train_once(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger);
-RcppExport SEXP BWPMF_train_once(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP RphiSEXP, SEXP loggerSEXP) {
+void train_once(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger, const std::string& item_update, SEXP Rmetrics);
+RcppExport SEXP BWPMF_train_once(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP RphiSEXP, SEXP loggerSEXP, SEXP item_updateSEXP, SEXP RmetricsSEXP) {
 BEGIN_RCPP
     Rcpp::RNGScope __rngScope;
     Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
     Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
     Rcpp::traits::input_parameter< SEXP >::type Rphi(RphiSEXP);
     Rcpp::traits::input_parameter< Function >::type logger(loggerSEXP);
-    train_once(Rmodel, Rhistory, Rphi, logger);
+    Rcpp::traits::input_parameter< const std::string& >::type item_update(item_updateSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rmetrics(RmetricsSEXP);
+    train_once(Rmodel, Rhistory, Rphi, logger, item_update, Rmetrics);
     return R_NilValue;
 END_RCPP
 }
+// init_metrics
+SEXP init_metrics(double capacity, const std::string& sink);
+RcppExport SEXP BWPMF_init_metrics(SEXP capacitySEXP, SEXP sinkSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< double >::type capacity(capacitySEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type sink(sinkSEXP);
+    __result = Rcpp::wrap(init_metrics(capacity, sink));
+    return __result;
+END_RCPP
+}
+// drain_metrics
+DataFrame drain_metrics(SEXP Rmetrics);
+RcppExport SEXP BWPMF_drain_metrics(SEXP RmetricsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmetrics(RmetricsSEXP);
+    __result = Rcpp::wrap(drain_metrics(Rmetrics));
+    return __result;
+END_RCPP
+}
+// train_load_stats
+DataFrame train_load_stats(SEXP Rmodel, bool reset);
+RcppExport SEXP BWPMF_train_load_stats(SEXP RmodelSEXP, SEXP resetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
+    Rcpp::traits::input_parameter< bool >::type reset(resetSEXP);
+    __result = Rcpp::wrap(train_load_stats(Rmodel, reset));
+    return __result;
+END_RCPP
+}
 // pmf_logloss
 double pmf_logloss(SEXP Rmodel, SEXP Rhistory);
 RcppExport SEXP BWPMF_pmf_logloss(SEXP RmodelSEXP, SEXP RhistorySEXP) {
@@ -365,3 +539,45 @@ BEGIN_RCPP
     return __result;
 END_RCPP
 }
+// train
+DataFrame train(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, int iterations, double tol, SEXP Rtesting, int eval_every, int patience, const std::string& item_update, SEXP Rmetrics, bool lagged_loss);
+RcppExport SEXP BWPMF_train(SEXP RmodelSEXP, SEXP RhistorySEXP, SEXP RphiSEXP, SEXP iterationsSEXP, SEXP tolSEXP, SEXP RtestingSEXP, SEXP eval_everySEXP, SEXP patienceSEXP, SEXP item_updateSEXP, SEXP RmetricsSEXP, SEXP lagged_lossSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rmodel(RmodelSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rphi(RphiSEXP);
+    Rcpp::traits::input_parameter< int >::type iterations(iterationsSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rtesting(RtestingSEXP);
+    Rcpp::traits::input_parameter< int >::type eval_every(eval_everySEXP);
+    Rcpp::traits::input_parameter< int >::type patience(patienceSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type item_update(item_updateSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rmetrics(RmetricsSEXP);
+    Rcpp::traits::input_parameter< bool >::type lagged_loss(lagged_lossSEXP);
+    __result = Rcpp::wrap(train(Rmodel, Rhistory, Rphi, iterations, tol, Rtesting, eval_every, patience, item_update, Rmetrics, lagged_loss));
+    return __result;
+END_RCPP
+}
+// sweep
+List sweep(SEXP Rhistory, List priors, IntegerVector K, SEXP Rtesting, int iterations, int threads, double tol, int eval_every, int patience, const std::string& storage, const std::string& item_update);
+RcppExport SEXP BWPMF_sweep(SEXP RhistorySEXP, SEXP priorsSEXP, SEXP KSEXP, SEXP RtestingSEXP, SEXP iterationsSEXP, SEXP threadsSEXP, SEXP tolSEXP, SEXP eval_everySEXP, SEXP patienceSEXP, SEXP storageSEXP, SEXP item_updateSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject __result;
+    Rcpp::RNGScope __rngScope;
+    Rcpp::traits::input_parameter< SEXP >::type Rhistory(RhistorySEXP);
+    Rcpp::traits::input_parameter< List >::type priors(priorsSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type K(KSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type Rtesting(RtestingSEXP);
+    Rcpp::traits::input_parameter< int >::type iterations(iterationsSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< double >::type tol(tolSEXP);
+    Rcpp::traits::input_parameter< int >::type eval_every(eval_everySEXP);
+    Rcpp::traits::input_parameter< int >::type patience(patienceSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type storage(storageSEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type item_update(item_updateSEXP);
+    __result = Rcpp::wrap(sweep(Rhistory, priors, K, Rtesting, iterations, threads, tol, eval_every, patience, storage, item_update));
+    return __result;
+END_RCPP
+}
@@ -0,0 +1,81 @@
+#ifndef __ALIGNED_ARRAY_H__
+#define __ALIGNED_ARRAY_H__
+
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+
+// A fixed size array whose storage starts on a cache line boundary so that
+// the K-wide rows of the parameter and phi slabs can be streamed linearly.
+template<typename T, size_t Alignment = 64>
+class AlignedArray {
+
+  size_t _size;
+
+  T *data;
+
+  static T* allocate(size_t n) {
+    if (n == 0) return nullptr;
+    void *p = nullptr;
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+public:
+
+  AlignedArray() : _size(0), data(nullptr) { }
+
+  explicit AlignedArray(size_t n) : _size(n), data(allocate(n)) { }
+
+  AlignedArray(const AlignedArray& src) : _size(src._size), data(allocate(src._size)) {
+    std::copy(src.data, src.data + _size, data);
+  }
+
+  void operator=(const AlignedArray& src) {
+    if (this == &src) return;
+    resize(src._size);
+    std::copy(src.data, src.data + _size, data);
+  }
+
+  ~AlignedArray() {
+    free(data);
+  }
+
+  // The content is discarded when the size changes.
+  void resize(size_t n) {
+    if (n == _size) return;
+    free(data);
+    data = nullptr;
+    _size = 0;
+    data = allocate(n);
+    _size = n;
+  }
+
+  void swap(AlignedArray& src) {
+    std::swap(_size, src._size);
+    std::swap(data, src.data);
+  }
+
+  T* get() {
+    return data;
+  }
+
+  const T* get() const {
+    return data;
+  }
+
+  T& operator[](size_t i) {
+    return data[i];
+  }
+
+  const T& operator[](size_t i) const {
+    return data[i];
+  }
+
+  const size_t size() const {
+    return _size;
+  }
+
+};
+
+#endif // __ALIGNED_ARRAY_H__
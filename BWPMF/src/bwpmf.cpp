@@ -1,73 +1,155 @@
 #include "stdafx.h"
 
-size_t Param::current_param_count = 0;
 
-int Param::K = 0;
+
+// Each thread counts the items of a static block of users, then the counts are
+// turned into the offsets of the (item, thread) pairs and each thread scatters
+// its block again. The two loops share the static schedule, so a thread sees
+// the same users in both of them and the users of an item stay sorted.
+//
+// The counts take `threads * item_size` words, so the threads are capped by
+// `total_size / item_size`: the counts are never larger than the index itself,
+// which is two words per nonzero.
+ItemIndex::ItemIndex(const ListOfList<ItemCount>& data, size_t _item_size)
+  : item_size(_item_size), index(_item_size + 1, 0),
+    user(data.get_total_size()), position(data.get_total_size())
+{
+  const size_t user_size = data.get_index_size();
+  const ItemCount *start = data.get_data();
+  std::vector<size_t> count;
+  int threads = 0;
+  const int max_threads = std::max<size_t>(std::min<size_t>(omp_get_max_threads(), data.get_total_size() / std::max<size_t>(item_size, 1)), 1);
+#pragma omp parallel num_threads(max_threads)
+  {
+    const int thread_id = omp_get_thread_num();
+#pragma omp single
+    {
+      threads = omp_get_num_threads();
+      count.resize(threads * item_size, 0);
+    }
+    size_t *local_count = &count[0] + thread_id * item_size;
+#pragma omp for schedule(static)
+    for(size_t u = 0;u < user_size;u++) {
+      for(size_t j = data.offset(u);j < data.offset(u + 1);j++) {
+        local_count[start[j].item]++;
+      }
+    }
+    // count[t, item] becomes the offset of thread t inside the item
+#pragma omp for
+    for(size_t item = 0;item < item_size;item++) {
+      size_t cumulated = 0;
+      for(int t = 0;t < threads;t++) {
+        const size_t tmp = count[t * item_size + item];
+        count[t * item_size + item] = cumulated;
+        cumulated += tmp;
+      }
+      index[item + 1] = cumulated;
+    }
+#pragma omp single
+    for(size_t item = 0;item < item_size;item++) {
+      index[item + 1] += index[item];
+    }
+#pragma omp for schedule(static)
+    for(size_t u = 0;u < user_size;u++) {
+      for(size_t j = data.offset(u);j < data.offset(u + 1);j++) {
+        const size_t item = start[j].item;
+        const size_t k = index[item] + local_count[item]++;
+        user[k] = u;
+        position[k] = j;
+      }
+    }
+  } // #pragma omp parallel
+}
 
 Model::Model() 
-  : K(0), prior(), user_size(0), item_size(0), user_param(NULL), item_param(NULL)
+  : K(0), prior(), user_size(0), item_size(0), user_param(), item_param(), context()
   { }
 
 Model::Model(const Model& m) 
   : K(m.K), prior(m.prior), user_size(m.user_size), item_size(m.item_size),
-    user_param(new Param[m.user_size]), item_param(new Param[m.item_size])
-  {
-    std::copy(m.user_param, m.user_param + m.user_size, user_param);
-    std::copy(m.item_param, m.item_param + m.item_size, item_param);
-  }
+    user_param(m.user_param), item_param(m.item_param), context()
+  { }
 
 void Model::operator=(const Model& m) {
-  delete [] user_param;
-  delete [] item_param;
   K = m.K;
   prior = m.prior;
   user_size = m.user_size;
   item_size = m.item_size;
-  user_param = new Param[user_size];
-  item_param = new Param[item_size];
-  std::copy(m.user_param, m.user_param + m.user_size, user_param);
-  std::copy(m.item_param, m.item_param + m.item_size, item_param);
+  user_param = m.user_param;
+  item_param = m.item_param;
+  context.reset();
 }
 
 Model::Model(const Prior& _prior, int _k, size_t _user_size, size_t _item_size)
   : K(_k), prior(_prior), user_size(_user_size), item_size(_item_size),
-    user_param(new Param[user_size]), item_param(new Param[item_size])
+    user_param(_k, user_size), item_param(_k, item_size), context()
   {
-    Param::set_K(_k);
+    init_param(0, 0);
+  }
+
+void Model::init_param(size_t user_begin, size_t item_begin) {
+  const int _k(K);
 #pragma omp parallel
-    {
-      unsigned int seed = omp_get_thread_num() + (int) time(NULL);
+  {
+    unsigned int seed = omp_get_thread_num() + (int) time(NULL);
 #pragma omp for
-      for(size_t i = 0;i < user_size;i++) {
-        Param& param(user_param[i]);
-        param.shp2 = prior.a2 + _k * prior.a1;
-        param.rte2 = prior.a2 / prior.b2* (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-        for(int k = 0;k < _k;k++) {
-          param.shp1[k] = prior.a1 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-          // param.rte1[k] = param.shp2 / param.rte2* (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-          param.rte1[k] = prior.b2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-        }
+    for(size_t i = user_begin;i < user_size;i++) {
+      ParamView param(user_param[i]);
+      param.shp2 = prior.a2 + _k * prior.a1;
+      param.rte2 = prior.a2 / prior.b2* (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+      for(int k = 0;k < _k;k++) {
+        param.shp1[k] = prior.a1 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+        // param.rte1[k] = param.shp2 / param.rte2* (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+        param.rte1[k] = prior.b2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
       }
+    }
 #pragma omp for
-      for(size_t item = 0;item < item_size;item++) {
-        Param& param(item_param[item]);
-        param.shp2 = prior.c2 + _k * prior.c1;
-        param.rte2 = prior.c2 / prior.d2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-        for(int k = 0;k < _k;k++) {
-          param.shp1[k] = prior.c1 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-          // param.rte1[k] = param.shp2 / param.rte2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-          param.rte1[k] = prior.d2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
-        }
+    for(size_t item = item_begin;item < item_size;item++) {
+      ParamView param(item_param[item]);
+      param.shp2 = prior.c2 + _k * prior.c1;
+      param.rte2 = prior.c2 / prior.d2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+      for(int k = 0;k < _k;k++) {
+        param.shp1[k] = prior.c1 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+        // param.rte1[k] = param.shp2 / param.rte2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
+        param.rte1[k] = prior.d2 * (0.9 + rand_r(&seed) * 0.2 / RAND_MAX);
       }
     }
   }
+}
+
+ParamBlock extend_param(const ParamBlock& block, size_t size) {
+  ParamBlock retval(block.K, size);
+  std::copy(block.shp1.get(), block.shp1.get() + block.size * block.K, retval.shp1.get());
+  std::copy(block.rte1.get(), block.rte1.get() + block.size * block.K, retval.rte1.get());
+  std::copy(block.shp2.begin(), block.shp2.end(), retval.shp2.begin());
+  std::copy(block.rte2.begin(), block.rte2.end(), retval.rte2.begin());
+  return retval;
+}
 
-Model::~Model() {
-  delete [] item_param;
-  delete [] user_param;
+void Model::extend(size_t _user_size, size_t _item_size) {
+  if (_user_size < user_size | _item_size < item_size) throw std::invalid_argument("The model cannot shrink");
+  const size_t user_begin = user_size, item_begin = item_size;
+  user_param = extend_param(user_param, _user_size);
+  item_param = extend_param(item_param, _item_size);
+  user_size = _user_size;
+  item_size = _item_size;
+  init_param(user_begin, item_begin);
+  context.reset();
 }
 
+Model::~Model() { }
+
+// The row layout of the models serialized before `ParamBlock`. It is only read
+// and it goes through the archive as a class just like the former `Param`.
+struct ParamRowV0 {
+  ParamView param;
+  int K;
+};
+
 BOOST_SERIALIZATION_SPLIT_FREE(Model)
+// version 0: the parameters are stored one `Param` after another
+// version 1: the parameters are stored as the slabs of `ParamBlock`
+BOOST_CLASS_VERSION(Model, 1)
 
 namespace boost {
 namespace serialization {
@@ -83,13 +165,29 @@ void serialize(Archive& ar, Prior& p, const unsigned int version) {
 }
 
 template<class Archive>
-void serialize(Archive& ar, Param& param, const unsigned int version) {
-  for(int k = 0;k < Param::K;k++) {
-    ar & param.rte1[k];
-    ar & param.shp1[k];
+void serialize(Archive& ar, ParamBlock& block, const unsigned int version) {
+  ar & make_array(block.shp1.get(), block.shp1.size());
+  ar & make_array(block.rte1.get(), block.rte1.size());
+  ar & make_array(block.shp2.data(), block.shp2.size());
+  ar & make_array(block.rte2.data(), block.rte2.size());
+}
+
+template<class Archive>
+void serialize(Archive& ar, ParamRowV0& row, const unsigned int version) {
+  for(int k = 0;k < row.K;k++) {
+    ar & row.param.rte1[k];
+    ar & row.param.shp1[k];
+  }
+  ar & row.param.rte2;
+  ar & row.param.shp2;
+}
+
+template<class Archive>
+void load_param_v0(Archive& ar, ParamBlock& block) {
+  for(size_t i = 0;i < block.size;i++) {
+    ParamRowV0 row = { block[i], block.K };
+    ar & row;
   }
-  ar & param.rte2;
-  ar & param.shp2;
 }
 
 template<class Archive>
@@ -97,32 +195,23 @@ void save(Archive& ar, const Model& m, const unsigned int version) {
   ar & m.K;
   ar & m.prior;
   ar & m.user_size;
-  for(size_t user = 0;user < m.user_size;user++) {
-    ar & m.user_param[user];
-  }
+  ar & m.user_param;
   ar & m.item_size;
-  for(size_t item = 0;item < m.item_size;item++) {
-    ar & m.item_param[item];
-  }
+  ar & m.item_param;
 }
 
 template<class Archive>
 void load(Archive& ar, Model& m, const unsigned int version) {
   ar & m.K;
-  Param::set_K(m.K);
   ar & m.prior;
   ar & m.user_size;
-  delete [] m.user_param;
-  m.user_param = new Param[m.user_size];
-  for(size_t user = 0;user < m.user_size;user++) {
-    ar & m.user_param[user];
-  }
+  m.user_param.resize(m.K, m.user_size);
+  if (version == 0) load_param_v0(ar, m.user_param);
+  else ar & m.user_param;
   ar & m.item_size;
-  delete [] m.item_param;
-  m.item_param = new Param[m.item_size];
-  for(size_t item = 0;item < m.item_size;item++) {
-    ar & m.item_param[item];
-  }
+  m.item_param.resize(m.K, m.item_size);
+  if (version == 0) load_param_v0(ar, m.item_param);
+  else ar & m.item_param;
 }
 
 }
@@ -139,7 +228,7 @@ double user_size(Model* m) {
 }
 
 SEXP user_param(Model* m, double i) {
-  return wrap(m->user_param[(size_t )i]);
+  return wrap(Param(m->user_param[(size_t )i], m->K));
 }
 
 double item_size(Model* m) {
@@ -147,7 +236,7 @@ double item_size(Model* m) {
 }
 
 SEXP item_param(Model* m, double i) {
-  return wrap(m->item_param[(size_t) i]);
+  return wrap(Param(m->item_param[(size_t) i], m->K));
 }
 
 void prior_show(Prior* p) {
@@ -157,11 +246,11 @@ void prior_show(Prior* p) {
 
 void param_show(Param* p) {
   Rprintf("Param: \n\tshp1: ");
-  for(int k = 0;k < Param::K;k++) {
+  for(int k = 0;k < p->K;k++) {
     Rprintf("%f ", p->shp1[k]);
   }
   Rprintf("\n\tshp2: %f\n\trte1: ", p->shp2);
-  for(int k = 0;k < Param::K;k++) {
+  for(int k = 0;k < p->K;k++) {
     Rprintf("%f ", p->rte1[k]);
   }
   Rprintf("\n\trte2: %f\n", p->rte2);
@@ -186,52 +275,55 @@ void model_deserialize(Model* m, const std::string& path) {
 }
 
 SEXP param_shp1(Param* param) {
-  NumericVector retval(Param::K);
-  for(int k = 0;k < Param::K;k++) {
+  NumericVector retval(param->K);
+  for(int k = 0;k < param->K;k++) {
     retval[k] = param->shp1[k];
   }
   return retval;
 }
 
 SEXP param_rte1(Param* param) {
-  NumericVector retval(Param::K);
-  for(int k = 0;k < Param::K;k++) {
+  NumericVector retval(param->K);
+  for(int k = 0;k < param->K;k++) {
     retval[k] = param->rte1[k];
   }
   return retval;
 }
 
+// K is kept by each model now, so this only checks the value. It is kept for
+// the scripts calling it before `init_model`.
 //[[Rcpp::export]]
 void set_K(int K) {
-  Param::set_K(K);
+  if (K <= 0) throw std::invalid_argument("K should be positive");
 }
 
-NumericMatrix model_export(Param* pparam, size_t param_size, int K) {
-  NumericMatrix retval(param_size, K);
+NumericMatrix model_export(const ParamBlock& block) {
+  const int K(block.K);
+  NumericMatrix retval(block.size, K);
+  const DTYPE *shp1 = block.shp1.get(), *rte1 = block.rte1.get();
 #pragma omp parallel for
-  for(size_t i = 0;i < param_size;i++) {
-    Param& param(pparam[i]);
+  for(size_t i = 0;i < block.size;i++) {
     for(int k = 0;k < K;k++) {
-      retval(i, k) = param.shp1[k] / param.rte1[k];
+      retval(i, k) = shp1[i * K + k] / rte1[i * K + k];
     }
   }
   return retval;
 }
 
 NumericMatrix model_export_user(Model* pmodel) {
-  return model_export(pmodel->user_param, pmodel->user_size, pmodel->K);
+  return model_export(pmodel->user_param);
 }
 
 NumericMatrix model_export_item(Model* pmodel) {
-  return model_export(pmodel->item_param, pmodel->item_size, pmodel->K);
+  return model_export(pmodel->item_param);
 }
 
-NumericMatrix model_export_with_name(Param* pparam, size_t param_size, int K, const std::string& encoder_path) {
-  NumericMatrix retval(model_export(pparam, param_size, K));
+NumericMatrix model_export_with_name(const ParamBlock& block, const std::string& encoder_path) {
+  NumericMatrix retval(model_export(block));
   Dictionary encoder;
   deserialize(encoder_path, encoder);
   List dimnames(2);
-  CharacterVector names(param_size);
+  CharacterVector names(block.size);
   for(const auto& metadata : encoder) {
     names[metadata.second] = Rf_mkCharLen(metadata.first.c_str(), metadata.first.size());
   }
@@ -241,11 +333,44 @@ NumericMatrix model_export_with_name(Param* pparam, size_t param_size, int K, co
 }
 
 SEXP model_export_user_with_name(Model* pmodel, const std::string& user_encoder_path) {
-  return model_export_with_name(pmodel->user_param, pmodel->user_size, pmodel->K, user_encoder_path);
+  return model_export_with_name(pmodel->user_param, user_encoder_path);
 }
 
 SEXP model_export_item_with_name(Model* pmodel, const std::string& item_encoder_path) {
-  return model_export_with_name(pmodel->item_param, pmodel->item_size, pmodel->K, item_encoder_path);
+  return model_export_with_name(pmodel->item_param, item_encoder_path);
+}
+
+// see encode.cpp
+std::vector<size_t> as_rank(const NumericVector& src, size_t size, const char* name);
+
+ParamBlock permute_param(const ParamBlock& block, const std::vector<size_t>& rank) {
+  ParamBlock retval(block.K, block.size);
+#pragma omp parallel for
+  for(size_t i = 0;i < block.size;i++) {
+    ConstParamView src(block[i]);
+    ParamView dst(retval[rank[i]]);
+    std::copy(src.shp1, src.shp1 + block.K, dst.shp1);
+    std::copy(src.rte1, src.rte1 + block.K, dst.rte1);
+    dst.shp2 = src.shp2;
+    dst.rte2 = src.rte2;
+  }
+  return retval;
+}
+
+// Moves the user u to `user[u]` and the item i to `item[i]`, see 
+// `order_history`. The phi of the model should be initialized again.
+void model_permute(Model* pmodel, NumericVector user, NumericVector item) {
+  Model& model(*pmodel);
+  model.user_param = permute_param(model.user_param, as_rank(user, model.user_size, "user"));
+  model.item_param = permute_param(model.item_param, as_rank(item, model.item_size, "item"));
+  model.context.reset();
+}
+
+// Appends the users and items of the new ids, see `Model::extend`. The phi of
+// the model should be initialized again.
+void model_extend(Model* pmodel, double user_size, double item_size) {
+  if (user_size < 0 | item_size < 0) throw std::invalid_argument("The sizes should be non-negative");
+  pmodel->extend(user_size, item_size);
 }
 
 RCPP_MODULE(model) {
@@ -284,6 +409,8 @@ RCPP_MODULE(model) {
     .method("export_item", &model_export_item)
     .method("export_user_with_name", &model_export_user_with_name)
     .method("export_item_with_name", &model_export_item_with_name)
+    .method("permute", &model_permute)
+    .method("extend", &model_extend)
   ;
 
 }
\ No newline at end of file
@@ -8,7 +8,12 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <memory>
+#include <cstdint>
+#include <atomic>
+#include <boost/serialization/version.hpp>
 #include "list_of_list.h"
+#include "aligned_array.h"
 
 typedef float DTYPE;
 
@@ -20,9 +25,9 @@ extern Dictionary cookie_dict, hostname_dict;
 // history
 struct ItemCount {
   
-  size_t item;
+  uint32_t item;
   
-  int count;
+  uint32_t count;
   
   ItemCount() : item(0), count(0) { }
   
@@ -37,35 +42,118 @@ struct ItemCount {
     count = src.count;
   }
   
+  // version 0: `size_t item` and `int count`
   template<class Archive>
   void serialize(Archive& ar, const unsigned int version) {
-    ar & item;
-    ar & count;
+    if (version == 0) {
+      size_t _item = item;
+      int _count = count;
+      ar & _item;
+      ar & _count;
+      item = _item;
+      count = _count;
+    } else {
+      ar & item;
+      ar & count;
+    }
+  }
+};
+
+BOOST_CLASS_VERSION(ItemCount, 1)
+
+// The item-major (CSC) companion of the user-major `History.data`. The nonzeros
+// of the item are `index[item]` to `index[item + 1]`: `user[j]` is the user and
+// `position[j]` is the offset of the same nonzero in `History.data`. The users
+// of each item are sorted.
+struct ItemIndex {
+  
+  size_t item_size;
+  
+  std::vector<size_t> index, user, position;
+  
+  ItemIndex() : item_size(0), index(1, 0), user(), position() { }
+  
+  // A parallel counting sort of `data`. It takes at most one word per nonzero
+  // or per item besides the index, see bwpmf.cpp
+  ItemIndex(const ListOfList<ItemCount>& data, size_t _item_size);
+  
+  const size_t degree(size_t item) const {
+    return index[item + 1] - index[item];
   }
+  
+  template<class Archive>
+  void serialize(Archive &ar, const unsigned int version) {
+    ar & item_size;
+    ar & index;
+    ar & user;
+    ar & position;
+  }
+  
 };
 
+// A distinct nonzero value for each call.
+inline uint64_t new_history_generation() {
+  static std::atomic<uint64_t> counter(0);
+  return ++counter;
+}
+
 struct History {
   
   size_t user_size, item_size;
 
   ListOfList<ItemCount> data;
+  
+  // built by `get_item_index` or loaded with the history
+  std::shared_ptr<ItemIndex> item_index;
+  
+  // It identifies the history and its data. A new history may reuse the 
+  // address of a freed one, so the caches of a training compare this instead,
+  // see `TrainContext`. It is renewed whenever the data is changed in place.
+  uint64_t generation;
 
-  History() : user_size(0), item_size(0), data() { }
+  History() : user_size(0), item_size(0), data(), generation(new_history_generation()) { }
     
   History(const std::vector<std::vector<ItemCount> >& src, const size_t _item_size)
-    : user_size(src.size()), item_size(_item_size), data(src)
+    : user_size(src.size()), item_size(_item_size), data(src), generation(new_history_generation())
+    { }
+  
+  // The nonzeros of the user u are `size[u]` uninitialized elements.
+  History(const std::vector<size_t>& size, const size_t _item_size)
+    : user_size(size.size()), item_size(_item_size), data(size), generation(new_history_generation())
     { }
   
   ~History() { }
   
+  // The trainings of several models may share the history, so the index is
+  // built once under a lock.
+  const ItemIndex& get_item_index() {
+#pragma omp critical(bwpmf_item_index)
+    {
+      if (!item_index) item_index.reset(new ItemIndex(data, item_size));
+    }
+    return *item_index;
+  }
+  
   template<class Archive>
   void serialize(Archive &ar, const unsigned int version) {
     ar & user_size;
     ar & item_size;
     ar & data;
+    if (version > 0) {
+      bool has_item_index = static_cast<bool>(item_index);
+      ar & has_item_index;
+      if (has_item_index) {
+        if (!item_index) item_index.reset(new ItemIndex());
+        ar & *item_index;
+      } else {
+        item_index.reset();
+      }
+    }
   }
 
 };
+
+BOOST_CLASS_VERSION(History, 1)
   
 struct Prior {
   double a1, a2, b2, c1, c2, d2;
@@ -75,34 +163,41 @@ struct Prior {
   Prior(const Prior& src) : a1(src.a1), a2(src.a2), b2(src.b2), c1(src.c1), c2(src.c2), d2(src.d2) { }
 };
 
+// A copy of the parameters of one user or item for R. The K is its own, so the
+// models of different K can live in one process.
 struct Param {
   
-  static int K;
-  
-  static size_t current_param_count;
-  
-  static void set_K(int k) {
-    if (k != K) {
-      if (current_param_count != 0) throw std::logic_error("K should be set before initializing Param");
-    }
-    K = k;
-  }
+  int K;
   
   DTYPE *shp1, *rte1;
   
   DTYPE shp2, rte2;
   
-  Param() : shp1(new DTYPE[K]), rte1(new DTYPE[K]), shp2(0.0), rte2(0.0) {
+  explicit Param(int _K) : K(_K), shp1(new DTYPE[_K]), rte1(new DTYPE[_K]), shp2(0.0), rte2(0.0) {
     std::fill_n(shp1, K, 0.0);
     std::fill_n(rte1, K, 0.0);
-    current_param_count++;
   }
   
-  Param(const Param& src) : Param() {
+  Param(const Param& src) : Param(src.K) {
     this->operator=(src);
   }
   
   void operator=(const Param& src) {
+    if (K != src.K) {
+      delete [] rte1;
+      delete [] shp1;
+      K = src.K;
+      shp1 = new DTYPE[K];
+      rte1 = new DTYPE[K];
+    }
+    std::copy(src.shp1, src.shp1 + K, shp1);
+    std::copy(src.rte1, src.rte1 + K, rte1);
+    shp2 = src.shp2;
+    rte2 = src.rte2;
+  }
+  
+  template<typename View>
+  Param(const View& src, int _K) : Param(_K) {
     std::copy(src.shp1, src.shp1 + K, shp1);
     std::copy(src.rte1, src.rte1 + K, rte1);
     shp2 = src.shp2;
@@ -116,12 +211,89 @@ struct Param {
   
 };
 
+// A view of the i-th row of a ParamBlock. It replaces `Param&` in the kernels.
+template<typename T>
+struct BasicParamView {
+  
+  T *shp1, *rte1;
+  
+  T &shp2, &rte2;
+  
+  BasicParamView(T* _shp1, T* _rte1, T& _shp2, T& _rte2) 
+    : shp1(_shp1), rte1(_rte1), shp2(_shp2), rte2(_rte2)
+    { }
+
+  template<typename U>
+  BasicParamView(const BasicParamView<U>& src)
+    : shp1(src.shp1), rte1(src.rte1), shp2(src.shp2), rte2(src.rte2)
+    { }
+
+};
+
+typedef BasicParamView<DTYPE> ParamView;
+
+typedef BasicParamView<const DTYPE> ConstParamView;
+
+// The parameters of `size` users (or items). `shp1` and `rte1` are stored 
+// as row-major `size x K` slabs so each row is contiguous.
+struct ParamBlock {
+  
+  int K;
+  
+  size_t size;
+  
+  AlignedArray<DTYPE> shp1, rte1;
+  
+  std::vector<DTYPE> shp2, rte2;
+  
+  ParamBlock() : K(0), size(0), shp1(), rte1(), shp2(), rte2() { }
+  
+  ParamBlock(int _K, size_t _size) 
+    : K(_K), size(_size), shp1(_K * _size), rte1(_K * _size), 
+      shp2(_size, 0.0), rte2(_size, 0.0)
+    {
+      std::fill(shp1.get(), shp1.get() + shp1.size(), 0.0);
+      std::fill(rte1.get(), rte1.get() + rte1.size(), 0.0);
+    }
+  
+  void resize(int _K, size_t _size) {
+    K = _K;
+    size = _size;
+    shp1.resize(_K * _size);
+    rte1.resize(_K * _size);
+    shp2.resize(_size);
+    rte2.resize(_size);
+  }
+  
+  ParamView operator[](size_t i) {
+#ifdef CHECK_BOUNDARY
+    if (i >= size) throw std::invalid_argument("i exceeds the size of ParamBlock");
+#endif
+    return ParamView(shp1.get() + i * K, rte1.get() + i * K, shp2[i], rte2[i]);
+  }
+  
+  ConstParamView operator[](size_t i) const {
+#ifdef CHECK_BOUNDARY
+    if (i >= size) throw std::invalid_argument("i exceeds the size of ParamBlock");
+#endif
+    return ConstParamView(shp1.get() + i * K, rte1.get() + i * K, shp2[i], rte2[i]);
+  }
+  
+};
+
+// see train.h
+struct TrainContext;
+
 struct Model {
   
   int K;
   Prior prior;
   size_t user_size, item_size;
-  Param *user_param, *item_param;
+  ParamBlock user_param, item_param;
+  
+  // The scratch buffers of the training of this model. It is created by the 
+  // first training and it is neither copied nor serialized.
+  std::shared_ptr<TrainContext> context;
 
   Model();
   
@@ -132,6 +304,15 @@ struct Model {
   void operator=(const Model& m);
   
   ~Model();
+  
+  // Initializes the users from `user_begin` and the items from `item_begin` 
+  // around the prior.
+  void init_param(size_t user_begin, size_t item_begin);
+  
+  // Grows the model to `user_size` users and `item_size` items, e.g. for the
+  // new ids of the dictionaries. The existing parameters are kept and the new 
+  // ones are initialized like the constructor.
+  void extend(size_t user_size, size_t item_size);
 
 };
 
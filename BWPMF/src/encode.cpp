@@ -103,88 +103,151 @@ void clean_hostname() {
   hostname_dict.reserve(0);
 }
 
-const std::string& first_comp(const std::string& src) {
-  static std::string buf;
-  auto delim = src.find((char) 3);
-  // Rprintf("%zd\n", delim);
-  if (delim == std::string::npos) {
-    buf.resize(0);
-  } else {
-    buf.assign(src, 0, delim);
+// The progress of the parallel parsers in lines.
+struct ParseProgress {
+
+  std::shared_ptr<boost::progress_display> pb;
+
+  explicit ParseProgress(double progress) : pb(progress > 0 ? new boost::progress_display(progress) : NULL) { }
+
+  void add(size_t lines) {
+    if (!pb) return;
+#pragma omp critical(bwpmf_parse_progress)
+    pb->operator+=(lines);
   }
-  return buf;
+
+};
+
+// Cuts the file into chunks for the threads, see `split_lines`.
+std::vector<const char*> split_chunks(const MappedFile& file) {
+  return split_lines(file.get_data(), file.get_size(), 4 * omp_get_max_threads());
 }
 
-const std::pair<std::string, int>& two_comp(const std::string& src) {
-  static std::pair<std::string, int> retval;
-  static std::string buf;
-  auto delim = src.find((char) 3);
-  buf.assign(src, delim + 1, src.size() - delim - 1);
-  if (delim == std::string::npos) {
-    retval.first.resize(0);
-  } else {
-    retval.first.assign(src, 0, delim);
-    retval.second = std::atoi(buf.c_str());
+// Calls `f(c, begin, end)` for each chunk on all threads. The tokens of 
+// `parse_line` are valid while the file is mapped.
+template<typename Function>
+void parse_chunks(const std::vector<const char*>& bound, Function f) {
+  const size_t chunks = bound.size() - 1;
+#pragma omp parallel for schedule(dynamic, 1)
+  for(size_t c = 0;c < chunks;c++) {
+    f(c, bound[c], bound[c + 1]);
   }
-  return retval;
 }
 
+// The new keys of a chunk in the order of their first occurrence.
+struct ChunkKeys {
+  std::vector<Token> cookie, hostname;
+  bool invalid;
+  ChunkKeys() : cookie(), hostname(), invalid(false) { }
+};
+
+// The chunks of the file are parsed in parallel, and their new keys are 
+// appended to the dictionaries in the order of the chunks, so the ids are the
+// order of the first occurrence in the file as a sequential scan.
 //[[Rcpp::export]]
 void encode(const std::string& path, size_t user_visit_lower_bound = 0, double progress = 0) {
-  std::ifstream input(path.c_str());
-  static std::vector<std::string> buf1, buf2;
-  std::shared_ptr<boost::progress_display> pb(NULL);
-  if (progress > 0) pb.reset(new boost::progress_display(progress));
-  for(std::string str ; std::getline(input, str);) {
-    if (progress > 0) pb->operator++();
-    boost::split(buf1, str, boost::is_any_of("\1"));
-    if (buf1.size() < 2) throw std::logic_error("invalid data");
-    std::string& cookie(buf1[0]);
-    boost::split(buf2, buf1[1], boost::is_any_of("\2"));
-    if (buf2.size() < 1) throw std::logic_error("invalid user data");
-    if (buf2.size() < user_visit_lower_bound) continue;
-    encode_cookie(cookie);
-    for(const std::string& s : buf2) {
-      const std::string& s2(first_comp(s));
-      if (s2.size() > 0) {
-        encode_hostname(s2);
+  const MappedFile file(path);
+  const std::vector<const char*> bound(split_chunks(file));
+  ParseProgress pb(progress);
+  std::vector<ChunkKeys> keys(bound.size() - 1);
+  parse_chunks(bound, [&](size_t c, const char* begin, const char* end) {
+    ChunkKeys& chunk(keys[c]);
+    std::unordered_set<Token, TokenHash> cookie_seen, hostname_seen;
+    std::vector<Visit> visits;
+    Token cookie;
+    size_t fields;
+    pb.add(for_each_line(begin, end, [&](const char* line_begin, const char* line_end) -> bool {
+      if (!parse_line(line_begin, line_end, cookie, visits, fields)) {
+        chunk.invalid = true;
+        return false;
       }
-    }
+      if (fields < user_visit_lower_bound) return true;
+      if (cookie_seen.insert(cookie).second) chunk.cookie.push_back(cookie);
+      for(const Visit& visit : visits) {
+        if (hostname_seen.insert(visit.hostname).second) chunk.hostname.push_back(visit.hostname);
+      }
+      return true;
+    }));
+  });
+  std::string buf;
+  for(const ChunkKeys& chunk : keys) {
+    for(const Token& cookie : chunk.cookie) encode_cookie(cookie.assign_to(buf));
+    for(const Token& hostname : chunk.hostname) encode_hostname(hostname.assign_to(buf));
+    if (chunk.invalid) throw std::logic_error("invalid data");
   }
 }
 
-
+// The users of a chunk and their nonzeros in `data`, which are stored in the 
+// order of the lines.
+struct ChunkData {
+  std::vector<size_t> user, size;
+  std::vector<ItemCount> data;
+  // the error of the line after the last user
+  const char* error;
+  ChunkData() : user(), size(), data(), error(NULL) { }
+};
+
+// The chunks of the file are parsed in parallel with the dictionaries read 
+// only, and the rows of the users are copied to the history in parallel. The
+// errors are reported in the order of the file as a sequential scan.
 //[[Rcpp::export]]
-SEXP encode_data(const std::string& path, double progress = 0) {
-  static std::vector<std::string> buf1, buf2;
-  std::shared_ptr<boost::progress_display> pb(NULL);
-  std::vector<std::vector<ItemCount> > history_buffer(cookie_dict.size(), std::vector<ItemCount>());
+SEXP encode_data(const std::string& path, double progress = 0, bool item_index = false) {
+  if (hostname_dict.size() > std::numeric_limits<uint32_t>::max()) throw std::logic_error("The number of hostnames exceeds the 32-bit item of ItemCount");
+  std::vector<ChunkData> chunks;
+  std::vector<size_t> size(cookie_dict.size(), 0);
+  std::vector<const ItemCount*> source(cookie_dict.size(), NULL);
   {
-    std::ifstream input(path.c_str());
-    if (progress > 0) pb.reset(new boost::progress_display(progress));
-    for(std::string str ; std::getline(input, str);) {
-      if (progress > 0) pb->operator++();
-      boost::split(buf1, str, boost::is_any_of("\1"));
-      if (buf1.size() < 2) throw std::logic_error("invalid data");
-      std::string& cookie(buf1[0]);
-      auto itor_cookie = cookie_dict.find(cookie);
-      if (itor_cookie == cookie_dict.end()) continue;
-      std::vector<ItemCount>& UserData(history_buffer[itor_cookie->second]);
-      if (UserData.size() > 0) throw std::logic_error("Duplicated cookie");
-      boost::split(buf2, buf1[1], boost::is_any_of("\2"));
-      if (buf2.size() < 1) throw std::logic_error("invalid user data");
-      for(const std::string& s : buf2) {
-        const std::pair<std::string, int>& comp(two_comp(s));
-        if (comp.first.size() > 0) {
-          auto itor_hostname = hostname_dict.find(comp.first);
-          if (itor_hostname == hostname_dict.end()) throw std::logic_error("Unknown hostname");
-          UserData.push_back(ItemCount(itor_hostname->second, comp.second));
+    const MappedFile file(path);
+    const std::vector<const char*> bound(split_chunks(file));
+    ParseProgress pb(progress);
+    chunks.resize(bound.size() - 1);
+    parse_chunks(bound, [&](size_t c, const char* begin, const char* end) {
+      ChunkData& chunk(chunks[c]);
+      std::string buf;
+      std::vector<Visit> visits;
+      Token cookie;
+      size_t fields;
+      pb.add(for_each_line(begin, end, [&](const char* line_begin, const char* line_end) -> bool {
+        if (!parse_line(line_begin, line_end, cookie, visits, fields)) {
+          chunk.error = "invalid data";
+          return false;
         }
-      }
+        auto itor_cookie = cookie_dict.find(cookie.assign_to(buf));
+        if (itor_cookie == cookie_dict.end()) return true;
+        chunk.user.push_back(itor_cookie->second);
+        const size_t before = chunk.data.size();
+        for(const Visit& visit : visits) {
+          auto itor_hostname = hostname_dict.find(visit.hostname.assign_to(buf));
+          if (itor_hostname == hostname_dict.end()) {
+            chunk.error = "Unknown hostname";
+            break;
+          }
+          chunk.data.push_back(ItemCount(itor_hostname->second, visit.count));
+        }
+        chunk.size.push_back(chunk.data.size() - before);
+        return chunk.error == NULL;
+      }));
+    });
+  }
+  for(const ChunkData& chunk : chunks) {
+    const ItemCount *data = chunk.data.data();
+    for(size_t j = 0;j < chunk.user.size();j++) {
+      const size_t user = chunk.user[j];
+      if (size[user] > 0) throw std::logic_error("Duplicated cookie");
+      size[user] = chunk.size[j];
+      source[user] = data;
+      data += chunk.size[j];
     }
+    if (chunk.error != NULL) throw std::logic_error(chunk.error);
   }
-  
-  return XPtr<History>(new History(history_buffer, hostname_dict.size()));
+  XPtr<History> retval(new History(size, hostname_dict.size()));
+  History& history(*retval);
+#pragma omp parallel for schedule(dynamic, 1024)
+  for(size_t user = 0;user < history.user_size;user++) {
+    std::copy(source[user], source[user] + size[user], history.data(user));
+  }
+  if (item_index) retval->get_item_index();
+  return retval;
 }
 
 //[[Rcpp::export]]
@@ -199,19 +262,52 @@ SEXP serialize_history(SEXP Rhistory, SEXP Rpath = R_NilValue) {
 }
 
 //[[Rcpp::export]]
-SEXP deserialize_history_raw(RawVector src) {
+SEXP deserialize_history_raw(RawVector src, bool item_index = false) {
   XPtr<History> retval(new History());
   rcpp_deserialize(*retval, src, true, true);
+  if (item_index) retval->get_item_index();
   return retval;
 }
 
 //[[Rcpp::export]]
-SEXP deserialize_history_path(const std::string& path) {
+SEXP deserialize_history_path(const std::string& path, bool item_index = false) {
   XPtr<History> retval(new History());
   deserialize(path, *retval);
+  if (item_index) retval->get_item_index();
   return retval;
 }
 
+// The item-major index is saved by `serialize_history` once it is built.
+//[[Rcpp::export]]
+void build_item_index(SEXP Rhistory) {
+  XPtr<History> phistory(Rhistory);
+  phistory->get_item_index();
+}
+
+//[[Rcpp::export]]
+bool has_item_index(SEXP Rhistory) {
+  XPtr<History> phistory(Rhistory);
+  return static_cast<bool>(phistory->item_index);
+}
+
+// The users who visited the item and their counts. It builds the item-major
+// index if it does not exist.
+//[[Rcpp::export]]
+DataFrame query_item_history(SEXP Rhistory, size_t item) {
+  XPtr<History> phistory(Rhistory);
+  History& history(*phistory);
+  if (item >= history.item_size) throw std::invalid_argument("item exceeds the item_size");
+  const ItemIndex& item_index(history.get_item_index());
+  const ItemCount *data = history.data.get_data();
+  NumericVector user(item_index.degree(item));
+  IntegerVector count(item_index.degree(item));
+  for(size_t j = item_index.index[item], i = 0;j < item_index.index[item + 1];j++, i++) {
+    user[i] = item_index.user[j];
+    count[i] = data[item_index.position[j]].count;
+  }
+  return DataFrame::create(Named("user") = user, Named("count") = count);
+}
+
 //[[Rcpp::export]]
 void print_history(SEXP Rhistory) {
   XPtr<History> phistory(Rhistory);
@@ -219,7 +315,7 @@ void print_history(SEXP Rhistory) {
   for(size_t user = 0;user < history.user_size;user++) {
     Rprintf("user(%zu): ", user);
     history.data(user, [](const ItemCount& ic) {
-      Rprintf("(item: %zu, count:%d) ", ic.item, ic.count);
+      Rprintf("(item: %u, count:%u) ", ic.item, ic.count);
     });
     Rprintf("\n");
   }
@@ -276,12 +372,9 @@ SEXP extract_history(SEXP Rhistory, NumericVector id) {
   std::sort(id.begin(), id.end());
   // calculate group of id
   std::vector<size_t> id_group(id.size(), 0);
-  const size_t *start = history.data.get_index(), *end = history.data.get_index() + history.data.get_index_size();
 #pragma omp parallel for
   for(size_t i = 0;i < id.size();i++) {
-    auto j = std::upper_bound(start, end, id[i] - 1);
-    auto group_idx = j - history.data.get_index();
-    id_group[i] = group_idx;
+    id_group[i] = history.data.upper_bound(id[i] - 1);
   }
   // pick out these samples
   std::vector< std::vector<ItemCount> > new_history_buffer(history.user_size, std::vector<ItemCount>());
@@ -295,7 +388,7 @@ SEXP extract_history(SEXP Rhistory, NumericVector id) {
       Rprintf("id_group[i]: %zu\n", id_group[i]);
       Rprintf("cumulative_group_size[id_group[i] - 1]): %zu\n", history.data.size(id_group[i] - 1));
 #endif
-      size_t inner_group_id = (id_group[i] > 0 ? id[i] - start[id_group[i] - 1] : id[i]);
+      size_t inner_group_id = (id_group[i] > 0 ? id[i] - history.data.offset(id_group[i] - 1) : id[i]);
 #ifdef NOISY_DEBUG
       Rprintf("inner_group_id: %zu\n", inner_group_id);
 #endif
@@ -303,11 +396,182 @@ SEXP extract_history(SEXP Rhistory, NumericVector id) {
       if (inner_group_id == 0) throw std::logic_error("Invalid size ( == 0 )");
       ItemCount* target = history.data(id_group[i] - 1) + (inner_group_id - 1);
       new_history_buffer[id_group[i] - 1].push_back(*target);
-      target->count = -1;
+      target->count = 0;
     }
   }
   history.data.clean([](const ItemCount& ic) {
     return ic.count > 0;
   });
+  history.item_index.reset();
+  history.generation = new_history_generation();
   return XPtr<History>(new History(new_history_buffer, history.item_size));
-}
\ No newline at end of file
+}
+// The degree of the users and the items, i.e. their numbers of nonzeros.
+void history_degree(const History& history, std::vector<size_t>& user_degree, std::vector<size_t>& item_degree) {
+  user_degree.assign(history.user_size, 0);
+  item_degree.assign(history.item_size, 0);
+  for(size_t user = 0;user < history.user_size;user++) {
+    auto item_range = history.data.range(user);
+    user_degree[user] = item_range.second - item_range.first;
+    for(const ItemCount *pitem_count = item_range.first;pitem_count != item_range.second;pitem_count++) {
+      item_degree[pitem_count->item]++;
+    }
+  }
+}
+
+// The rank of the vertices sorted by `degree` in descending order. Ties keep
+// the original order.
+std::vector<size_t> rank_by_degree(const std::vector<size_t>& degree) {
+  std::vector<size_t> order(degree.size()), retval(degree.size());
+  for(size_t i = 0;i < order.size();i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&degree](size_t a, size_t b) {
+    return degree[a] > degree[b];
+  });
+  for(size_t i = 0;i < order.size();i++) retval[order[i]] = i;
+  return retval;
+}
+
+// The reverse Cuthill-McKee order of the bipartite graph of the users and 
+// items. The vertex v is the user v if v < user_size, otherwise the item 
+// v - user_size. Each component starts from its vertex of the least degree and
+// the neighbors are visited by their degree in ascending order. The users and 
+// the items are then ranked separately by their position in the order.
+void rank_by_rcm(History& history, std::vector<size_t>& user_rank, std::vector<size_t>& item_rank) {
+  const size_t user_size = history.user_size, size = history.user_size + history.item_size;
+  const ItemIndex& item_index(history.get_item_index());
+  std::vector<size_t> degree, item_degree;
+  history_degree(history, degree, item_degree);
+  degree.insert(degree.end(), item_degree.begin(), item_degree.end());
+  std::vector<size_t> start(size);
+  for(size_t v = 0;v < size;v++) start[v] = v;
+  std::stable_sort(start.begin(), start.end(), [&degree](size_t a, size_t b) {
+    return degree[a] < degree[b];
+  });
+  auto by_degree = [&degree](size_t a, size_t b) {
+    return degree[a] < degree[b];
+  };
+  std::vector<bool> visited(size, false);
+  std::vector<size_t> order;
+  order.reserve(size);
+  for(size_t s : start) {
+    if (visited[s]) continue;
+    visited[s] = true;
+    order.push_back(s);
+    for(size_t head = order.size() - 1;head < order.size();head++) {
+      const size_t v = order[head], first = order.size();
+      if (v < user_size) {
+        history.data(v, [&](const ItemCount& ic) {
+          const size_t w = user_size + ic.item;
+          if (visited[w]) return;
+          visited[w] = true;
+          order.push_back(w);
+        });
+      } else {
+        for(size_t j = item_index.index[v - user_size];j < item_index.index[v - user_size + 1];j++) {
+          const size_t w = item_index.user[j];
+          if (visited[w]) continue;
+          visited[w] = true;
+          order.push_back(w);
+        }
+      }
+      std::stable_sort(order.begin() + first, order.end(), by_degree);
+    }
+  }
+  user_rank.resize(history.user_size);
+  item_rank.resize(history.item_size);
+  size_t user_count = 0, item_count = 0;
+  for(auto v = order.rbegin();v != order.rend();v++) {
+    if (*v < user_size) user_rank[*v] = user_count++;
+    else item_rank[*v - user_size] = item_count++;
+  }
+}
+
+void order_history(History& history, const std::string& method, std::vector<size_t>& user_rank, std::vector<size_t>& item_rank) {
+  if (method.compare("none") == 0) {
+    user_rank.resize(history.user_size);
+    item_rank.resize(history.item_size);
+    for(size_t i = 0;i < user_rank.size();i++) user_rank[i] = i;
+    for(size_t i = 0;i < item_rank.size();i++) item_rank[i] = i;
+  } else if (method.compare("frequency") == 0) {
+    std::vector<size_t> user_degree, item_degree;
+    history_degree(history, user_degree, item_degree);
+    user_rank = rank_by_degree(user_degree);
+    item_rank = rank_by_degree(item_degree);
+  } else if (method.compare("rcm") == 0) {
+    rank_by_rcm(history, user_rank, item_rank);
+  } else {
+    throw std::invalid_argument("Unknown method of the order: " + method);
+  }
+}
+
+// The new id of the users and the items for the locality of the training:
+// - "none": the original order.
+// - "frequency": by the number of nonzeros in descending order, so the hot
+//   items share the cache lines.
+// - "rcm": the reverse Cuthill-McKee order, so the users visiting the same 
+//   items are neighbors and the items of a user are close to each other.
+// The `user` and `item` of the result are the new ids of the original ids. 
+// Please apply them with `permute_history`, `permute_dictionary` and the
+// `permute` of the model.
+//[[Rcpp::export]]
+List order_history(SEXP Rhistory, const std::string& method = "frequency") {
+  XPtr<History> phistory(Rhistory);
+  std::vector<size_t> user_rank, item_rank;
+  order_history(*phistory, method, user_rank, item_rank);
+  return List::create(Named("user") = wrap(user_rank), Named("item") = wrap(item_rank));
+}
+
+// Checks that `src` is a permutation of 0, ..., size - 1.
+std::vector<size_t> as_rank(const NumericVector& src, size_t size, const char* name) {
+  if (static_cast<size_t>(src.size()) != size) throw std::invalid_argument(std::string("The size of ") + name + " is inconsistent");
+  std::vector<size_t> retval(size);
+  std::vector<bool> used(size, false);
+  for(size_t i = 0;i < size;i++) {
+    if (!(src[i] >= 0 & src[i] < size)) throw std::invalid_argument(std::string("Invalid rank of ") + name);
+    retval[i] = src[i];
+    if (used[retval[i]]) throw std::invalid_argument(std::string("Duplicated rank of ") + name);
+    used[retval[i]] = true;
+  }
+  return retval;
+}
+
+// A copy of the history whose user u is `user[u]` and item i is `item[i]`. 
+// The items of each user are sorted by their new id. The item-major index is
+// rebuilt if the history has one.
+//[[Rcpp::export]]
+SEXP permute_history(SEXP Rhistory, NumericVector user, NumericVector item) {
+  XPtr<History> phistory(Rhistory);
+  History& history(*phistory);
+  const std::vector<size_t> user_rank(as_rank(user, history.user_size, "user")), item_rank(as_rank(item, history.item_size, "item"));
+  std::vector< std::vector<ItemCount> > history_buffer(history.user_size, std::vector<ItemCount>());
+#pragma omp parallel for
+  for(size_t u = 0;u < history.user_size;u++) {
+    std::vector<ItemCount>& user_data(history_buffer[user_rank[u]]);
+    user_data.reserve(history.data.size(u));
+    history.data(u, [&](const ItemCount& ic) {
+      user_data.push_back(ItemCount(item_rank[ic.item], ic.count));
+    });
+    std::sort(user_data.begin(), user_data.end(), [](const ItemCount& a, const ItemCount& b) {
+      return a.item < b.item;
+    });
+  }
+  XPtr<History> retval(new History(history_buffer, history.item_size));
+  if (history.item_index) retval->get_item_index();
+  return retval;
+}
+
+void permute_dictionary(Dictionary& dict, const std::vector<size_t>& rank) {
+  for(auto& metadata : dict) {
+    metadata.second = rank[metadata.second];
+  }
+}
+
+// Relabels the dictionaries of the cookies and hostnames like `permute_history`,
+// so `query_cookie`, `query_hostname` and the serialized dictionaries follow 
+// the permuted history.
+//[[Rcpp::export]]
+void permute_dictionary(NumericVector user, NumericVector item) {
+  const std::vector<size_t> user_rank(as_rank(user, cookie_dict.size(), "user")), item_rank(as_rank(item, hostname_dict.size(), "item"));
+  permute_dictionary(cookie_dict, user_rank);
+  permute_dictionary(hostname_dict, item_rank);
+}
@@ -0,0 +1,103 @@
+#ifndef __KERNEL_H__
+#define __KERNEL_H__
+
+#include "bwpmf.h"
+
+// The K-wide loops of the trainer. `KS` is the number of latent factors fixed
+// at compile time, or 0 if K is only known at runtime. With a constant trip
+// count the compiler unrolls and vectorizes these loops with the instruction
+// set it is allowed to use, e.g. `CXX11FLAGS = -march=native` in ~/.R/Makevars.
+template<int KS>
+struct Kernel {
+
+  static inline int width(const int K) {
+    return KS > 0 ? KS : K;
+  }
+
+  // phi[k] = a[k] * b[k] / sum_j(a[j] * b[j])
+  static inline void phi(const DTYPE* a, const DTYPE* b, DTYPE* phi, const int _K) {
+    const int K(width(_K));
+    DTYPE denom = 0.0;
+#pragma omp simd reduction(+:denom)
+    for(int k = 0;k < K;k++) {
+      phi[k] = a[k] * b[k];
+      denom += phi[k];
+    }
+    const DTYPE scale = 1.0 / denom;
+#pragma omp simd
+    for(int k = 0;k < K;k++) {
+      phi[k] *= scale;
+    }
+  }
+
+  // target[k] += y * x[k]
+  template<typename T>
+  static inline void axpy(const DTYPE y, const DTYPE* x, T* target, const int _K) {
+    const int K(width(_K));
+#pragma omp simd
+    for(int k = 0;k < K;k++) {
+      target[k] += y * x[k];
+    }
+  }
+
+  // target[k] += y * x[k] where the target is shared with the other threads
+  static inline void atomic_axpy(const DTYPE y, const DTYPE* x, DTYPE* target, const int _K) {
+    const int K(width(_K));
+    for(int k = 0;k < K;k++) {
+      const DTYPE tmp = y * x[k];
+#pragma omp atomic
+      target[k] += tmp;
+    }
+  }
+
+  // target[k] += shp1[k] / rte1[k] and returns sum_k(shp1[k] / rte1[k])
+  template<typename T>
+  static inline double mean(const DTYPE* shp1, const DTYPE* rte1, T* target, const int _K) {
+    const int K(width(_K));
+    double retval = 0.0;
+#pragma omp simd reduction(+:retval)
+    for(int k = 0;k < K;k++) {
+      const double score = shp1[k] / rte1[k];
+      target[k] += score;
+      retval += score;
+    }
+    return retval;
+  }
+
+  // mean[k] = shp1[k] / rte1[k] and target[k] += mean[k]
+  template<typename T>
+  static inline void posterior_mean(const DTYPE* shp1, const DTYPE* rte1, DTYPE* mean, T* target, const int _K) {
+    const int K(width(_K));
+#pragma omp simd
+    for(int k = 0;k < K;k++) {
+      mean[k] = shp1[k] / rte1[k];
+      target[k] += mean[k];
+    }
+  }
+
+  // sum_k(a[k] * b[k]), e.g. lambda of the posterior means of a user and an item
+  static inline double dot(const DTYPE* a, const DTYPE* b, const int _K) {
+    const int K(width(_K));
+    double retval = 0.0;
+#pragma omp simd reduction(+:retval)
+    for(int k = 0;k < K;k++) {
+      retval += a[k] * b[k];
+    }
+    return retval;
+  }
+
+};
+
+// Calls `FUN<K>(...)` for the specialized K and `FUN<0>(...)` otherwise. It
+// returns from the enclosing function.
+#define BWPMF_DISPATCH_K(K, FUN, ...) \
+  switch(K) { \
+  case 8: return FUN<8>(__VA_ARGS__); \
+  case 16: return FUN<16>(__VA_ARGS__); \
+  case 32: return FUN<32>(__VA_ARGS__); \
+  case 64: return FUN<64>(__VA_ARGS__); \
+  case 128: return FUN<128>(__VA_ARGS__); \
+  default: return FUN<0>(__VA_ARGS__); \
+  }
+
+#endif // __KERNEL_H__
@@ -6,108 +6,134 @@
 #include <algorithm>
 #include <iostream>
 #include <iterator>
+#include <numeric>
+#include <limits>
+#include <cstdint>
 #include <boost/serialization/split_member.hpp>
+#include <boost/serialization/array.hpp>
+#include <boost/serialization/version.hpp>
 #ifdef NOISY_DEBUG
 #include <Rcpp.h>
 #endif // NOISY_DEBUG
 
+// A list of lists stored as one array in CSR order. The offsets are 32-bit 
+// unless the total size exceeds 2^32 (or `wide` is requested), and the layout
+// is recorded in the serialization.
 template<typename T>
 class ListOfList {
   
   size_t total_size;
   size_t index_size;
-  size_t *index;
+  bool wide;
+  uint32_t *index32;
+  size_t *index64;
   T *data;
   
   ListOfList(const ListOfList&);
   void operator=(const ListOfList&);
   
-  ListOfList(size_t _total_size, size_t _index_size) 
+  ListOfList(size_t _total_size, size_t _index_size, bool _wide) 
     : total_size(_total_size), index_size(_index_size), 
-      index(new size_t[_index_size + 1]), data(new T[_total_size])
+      wide(_wide || _total_size > std::numeric_limits<uint32_t>::max()),
+      index32(wide ? nullptr : new uint32_t[_index_size + 1]), 
+      index64(wide ? new size_t[_index_size + 1] : nullptr),
+      data(new T[_total_size])
   { }
+  
+  void set_offset(size_t i, size_t value) {
+    if (wide) index64[i] = value;
+    else index32[i] = value;
+  }
 
 public:
   
-  ListOfList() : total_size(0), index_size(0), index(nullptr), data(nullptr) 
+  ListOfList() : total_size(0), index_size(0), wide(false), index32(nullptr), index64(nullptr), data(nullptr) 
   { }
   
-  ListOfList(const std::vector< std::vector<T> >& src) 
-    : ListOfList(std::accumulate(src.begin(), src.end(), 0, [](const size_t& retval, const std::vector<T>& i) {
+  ListOfList(const std::vector< std::vector<T> >& src, bool _wide = false) 
+    : ListOfList(std::accumulate(src.begin(), src.end(), (size_t) 0, [](const size_t& retval, const std::vector<T>& i) {
         return retval + i.size();
-    }), src.size())
+    }), src.size(), _wide)
   {
-    index[0] = 0;
+    set_offset(0, 0);
     size_t counter = 0;
     for(size_t i = 0;i < index_size;i++) {
-      index[i + 1] = index[i] + src[i].size();
+      set_offset(i + 1, offset(i) + src[i].size());
       for(const auto& element : src[i]) {
         data[counter++] = element;
       }
     }
   }
   
-  ListOfList(const std::vector<size_t>& _size)
-    : ListOfList(std::accumulate(_size.begin(), _size.end(), 0), _size.size())
+  ListOfList(const std::vector<size_t>& _size, bool _wide = false)
+    : ListOfList(std::accumulate(_size.begin(), _size.end(), (size_t) 0), _size.size(), _wide)
   {
-    index[0] = 0;
+    set_offset(0, 0);
     for(size_t i = 0;i < _size.size();i++) {
-      index[i + 1] = index[i] + _size[i];
+      set_offset(i + 1, offset(i) + _size[i]);
     }
   }
   
   ListOfList(const size_t* _size, size_t _index_size, bool diff = false)
-    : ListOfList((diff ? _size[_index_size] : std::accumulate(_size, _size + _index_size, 0)), _index_size)
+    : ListOfList((diff ? _size[_index_size] : std::accumulate(_size, _size + _index_size, (size_t) 0)), _index_size, false)
   {
     if (diff) {
-      std::copy(_size, _size + _index_size + 1, index);
+      for(size_t i = 0;i < _index_size + 1;i++) {
+        set_offset(i, _size[i]);
+      }
     } else {
-      index[0] = 0;
+      set_offset(0, 0);
       for(size_t i = 0;i < _index_size;i++) {
-        index[i + 1] = index[i]  + _size[i];
+        set_offset(i + 1, offset(i) + _size[i]);
       }
     }
   }
   
   ~ListOfList() {
-    delete [] index;
+    delete [] index32;
+    delete [] index64;
     delete [] data;
   }
+  
+  // The begin of the i-th list, and the end of the (i-1)-th list
+  const size_t offset(size_t i) const {
+    return wide ? index64[i] : index32[i];
+  }
 
   T* operator()(size_t i) {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
-    return data + index[i];
+    return data + offset(i);
   }
   
   const T* operator()(size_t i) const {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
-    return data + index[i];
+    return data + offset(i);
   }
   
   std::pair<T*,T*> range(size_t i) {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
-    return std::make_pair(data + index[i], data + index[i+1]);
+    return std::make_pair(data + offset(i), data + offset(i + 1));
   }
   
   std::pair<const T*, const T*> range(size_t i) const {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
-    return std::make_pair(data + index[i], data + index[i+1]);
+    return std::make_pair(data + offset(i), data + offset(i + 1));
   }
   
   T& operator()(size_t i, size_t j) {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
-    if (index[i] + j >= index[i + 1]) throw std::invalid_argument("j exceeds the size of i-th list");
+    if (offset(i) + j >= offset(i + 1)) throw std::invalid_argument("j exceeds the size of i-th list");
 #endif
-    return data[index[i] + j];
+    return data[offset(i) + j];
   }
   
   template<class UnaryFunction>
@@ -116,8 +142,8 @@ public:
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
     T 
-      *begin = data + index[i],
-      *end = data + index[i + 1];
+      *begin = data + offset(i),
+      *end = data + offset(i + 1);
     std::for_each(begin, end, f);
   }
   
@@ -129,24 +155,35 @@ public:
     return index_size;
   }
   
-  const size_t* get_index() const {
-    return index;
+  const bool is_wide() const {
+    return wide;
+  }
+  
+  // The list which contains the j-th element is `upper_bound(j) - 1`.
+  const size_t upper_bound(size_t j) const {
+    if (wide) return std::upper_bound(index64, index64 + index_size, j) - index64;
+    else return std::upper_bound(index32, index32 + index_size, j) - index32;
+  }
+  
+  const T* get_data() const {
+    return data;
   }
   
   const size_t size(size_t i) const {
 #ifdef CHECK_BOUNDARY
     if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
 #endif
-    return index[i+1] - index[i];
+    return offset(i + 1) - offset(i);
   }
   
   template<class UnaryOperator>
   void clean(UnaryOperator f) {
     size_t total_adj = 0;
     size_t k = 0;
-    size_t index_begin = index[0];
+    size_t index_begin = offset(0);
     for(size_t i = 0;i < index_size;i++) {
-      for(size_t j = index_begin;j < index[i+1];j++) {
+      const size_t index_end = offset(i + 1);
+      for(size_t j = index_begin;j < index_end;j++) {
         if (!f(data[j])) total_adj += 1;
         if (j > k) {
           data[k] = data[j];
@@ -154,10 +191,10 @@ public:
         if (f(data[k])) k++; 
       }
 #ifdef NOISY_DEBUG
-      Rprintf("%uz - %uz \n", index[i+1], total_adj);
+      Rprintf("%uz - %uz \n", index_end, total_adj);
 #endif
-      index_begin = index[i + 1];
-      index[i + 1] -= total_adj;
+      index_begin = index_end;
+      set_offset(i + 1, index_end - total_adj);
     }
     total_size -= total_adj;
   }
@@ -166,8 +203,9 @@ public:
     os << "total_size: " << total_size << "\n";
     os << "index_size: " << index_size << "\n";
     os << "index:" << "\n\t";
-    std::ostream_iterator<size_t> out_it1 ( os, "\n\t");
-    std::copy(index, index + index_size + 1, out_it1);
+    for(size_t i = 0;i < index_size + 1;i++) {
+      os << offset(i) << "\n\t";
+    }
     os << "\n";
     os << "data:" << "\n\t";
     std::ostream_iterator<T> out_it2 ( os, "\n\t" );
@@ -182,24 +220,40 @@ private:
   void save(Archive &ar, const unsigned int version) const {
     ar & total_size;
     ar & index_size;
-    for(size_t i = 0;i < index_size + 1;i++) {
-      ar & index[i];
-    }
+    ar & wide;
+    if (wide) ar & boost::serialization::make_array(index64, index_size + 1);
+    else ar & boost::serialization::make_array(index32, index_size + 1);
     for(size_t i = 0;i < total_size;i++) {
       ar & data[i];
     }
   }
   
+  // version 0: the offsets are `size_t` and they are narrowed if possible
+  // version 1: the width of the offsets is recorded before them
   template<class Archive>
   void load(Archive &ar, const unsigned int version) {
-    delete [] index;
+    delete [] index32;
+    delete [] index64;
     delete [] data;
+    index32 = nullptr;
+    index64 = nullptr;
     ar & total_size;
     data = new T[total_size];
     ar & index_size;
-    index = new size_t[index_size + 1];
-    for(size_t i = 0;i < index_size + 1;i++) {
-      ar & index[i];
+    if (version > 0) ar & wide;
+    else wide = total_size > std::numeric_limits<uint32_t>::max();
+    if (wide) index64 = new size_t[index_size + 1];
+    else index32 = new uint32_t[index_size + 1];
+    if (version == 0) {
+      for(size_t i = 0;i < index_size + 1;i++) {
+        size_t value;
+        ar & value;
+        set_offset(i, value);
+      }
+    } else if (wide) {
+      ar & boost::serialization::make_array(index64, index_size + 1);
+    } else {
+      ar & boost::serialization::make_array(index32, index_size + 1);
     }
     for(size_t i = 0;i < total_size;i++) {
       ar & data[i];
@@ -209,4 +263,17 @@ private:
 
 };
 
+namespace boost {
+namespace serialization {
+
+template<typename T>
+struct version< ListOfList<T> > {
+  typedef mpl::int_<1> type;
+  typedef mpl::integral_c_tag tag;
+  BOOST_STATIC_CONSTANT(int, value = version::type::value);
+};
+
+}
+}
+
 #endif //__LIST_OF_LIST_H__
\ No newline at end of file
@@ -0,0 +1,209 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <omp.h>
+
+// The phases of an iteration. In the fused storage, the phase of phi includes
+// the update of the users and the phase of the users is empty.
+enum MetricPhase {
+  METRIC_PHASE_PHI = 0,
+  METRIC_PHASE_USER = 1,
+  METRIC_PHASE_ITEM = 2
+};
+
+// - METRIC_WALL: the seconds of the phase of the whole team (thread -1).
+// - METRIC_BUSY: the seconds a thread worked in the phase.
+// - METRIC_IDLE: the seconds a thread waited for the others at the end of the
+//   phase.
+// - METRIC_NNZ_PER_SECOND: the nonzeros visited per second by the team.
+// - METRIC_IO_BYTES: the bytes of phi a thread read or wrote in the disk
+//   storage.
+enum MetricType {
+  METRIC_WALL = 0,
+  METRIC_BUSY = 1,
+  METRIC_IDLE = 2,
+  METRIC_NNZ_PER_SECOND = 3,
+  METRIC_IO_BYTES = 4
+};
+
+inline const char* metric_phase_name(int phase) {
+  static const char* names[] = { "phi", "user", "item" };
+  return names[phase];
+}
+
+inline const char* metric_type_name(int type) {
+  static const char* names[] = { "wall", "busy", "idle", "nnz_per_second", "io_bytes" };
+  return names[type];
+}
+
+struct MetricRecord {
+  uint32_t iteration;
+  int16_t thread;
+  uint8_t phase;
+  uint8_t type;
+  double value;
+};
+
+// A bounded ring of `MetricRecord` written by the threads of a parallel region
+// without any lock and read after the region, so the threads never call back
+// into R. A writer claims a slot with an atomic increment of `head`. The
+// reader only runs outside of the parallel regions, so `tail` is constant
+// while the slots are written and the join of the region publishes them. The
+// records exceeding the capacity are dropped instead of overwriting the ones
+// not drained yet, and counted in `dropped`.
+//
+// `flush` is called after every parallel region and between the iterations of
+// `train`. It settles `head` and appends the new records to the text file 
+// `sink` if it is not empty, one record per line separated by tabs, for the
+// batch jobs without an R session. The sink is then the reader: the written
+// records are released for the next ones, and `drain` no longer returns them.
+class MetricsChannel {
+
+  std::vector<MetricRecord> ring;
+
+  const uint64_t mask;
+
+  std::atomic<uint64_t> head;
+
+  uint64_t tail, flushed, dropped;
+
+  std::string sink;
+
+  // the first error of the sink, see `check_error`
+  std::string error;
+
+  static uint64_t round_capacity(size_t capacity) {
+    if (capacity == 0) throw std::invalid_argument("The capacity of metrics should be positive");
+    uint64_t retval = 1;
+    while(retval < capacity) retval <<= 1;
+    return retval;
+  }
+
+public:
+
+  // The iteration of the records. It is only changed outside of the parallel
+  // regions or by the master thread before a barrier.
+  uint32_t iteration;
+
+  explicit MetricsChannel(size_t capacity, const std::string& _sink = "")
+    : ring(round_capacity(capacity)), mask(ring.size() - 1), head(0),
+      tail(0), flushed(0), dropped(0), sink(_sink), error(), iteration(0)
+    { }
+
+  void push(uint8_t phase, uint8_t type, int thread, double value) {
+    const uint64_t i = head.fetch_add(1, std::memory_order_relaxed);
+    if (i - tail > mask) return;
+    MetricRecord& record(ring[i & mask]);
+    record.iteration = iteration;
+    record.thread = thread;
+    record.phase = phase;
+    record.type = type;
+    record.value = value;
+  }
+
+  // the position of the next record
+  const uint64_t position() const {
+    return head.load(std::memory_order_relaxed);
+  }
+
+  const MetricRecord& operator[](uint64_t i) const {
+    return ring[i & mask];
+  }
+
+  // It may run in the master thread of a parallel region while the others 
+  // push nothing, so an error of the sink is kept instead of thrown.
+  void flush() {
+    uint64_t end = head.load(std::memory_order_relaxed);
+    if (end - tail > ring.size()) {
+      dropped += end - tail - ring.size();
+      end = tail + ring.size();
+      head.store(end, std::memory_order_relaxed);
+    }
+    if (!sink.empty() & flushed < end) {
+      std::ofstream out(sink.c_str(), std::ios::app);
+      for(uint64_t i = std::max(flushed, tail);out && i < end;i++) {
+        const MetricRecord& record((*this)[i]);
+        out << record.iteration << '\t' << metric_phase_name(record.phase) << '\t' << record.thread << '\t'
+            << metric_type_name(record.type) << '\t' << record.value << '\n';
+      }
+      if (!out & error.empty()) error = "Failed to write the sink of metrics";
+      tail = end;
+    }
+    flushed = end;
+  }
+
+  // Throws the first error of the sink since the last call. It must be called
+  // outside of the parallel regions.
+  void check_error() {
+    std::string msg;
+    msg.swap(error);
+    if (!msg.empty()) throw std::runtime_error(msg);
+  }
+
+  // Calls `fun` with the records not drained and discards them. It returns the
+  // number of the dropped records since the last drain.
+  template<typename Fun>
+  uint64_t drain(Fun fun) {
+    flush();
+    const uint64_t end = head.load(std::memory_order_relaxed);
+    for(;tail < end;tail++) {
+      fun((*this)[tail]);
+    }
+    const uint64_t retval = dropped;
+    dropped = 0;
+    return retval;
+  }
+
+};
+
+// Times the phases of an iteration in one thread. `work_done` is called once
+// the thread finished its share of the phase and `end` after the barrier of
+// the phase, which also starts the next phase. A NULL channel records nothing.
+class PhaseTimer {
+
+  typedef std::chrono::steady_clock Clock;
+
+  MetricsChannel* channel;
+
+  const int thread;
+
+  Clock::time_point start, done;
+
+public:
+
+  explicit PhaseTimer(MetricsChannel* _channel)
+    : channel(_channel), thread(omp_get_thread_num()), start(Clock::now()), done(start)
+    { }
+
+  void work_done() {
+    if (channel != NULL) done = Clock::now();
+  }
+
+  // `nnz` is the number of the nonzeros visited by the team in the phase
+  void end(MetricPhase phase, size_t nnz) {
+    if (channel == NULL) return;
+    const Clock::time_point now(Clock::now());
+    channel->push(phase, METRIC_BUSY, thread, std::chrono::duration<double>(done - start).count());
+    channel->push(phase, METRIC_IDLE, thread, std::chrono::duration<double>(now - done).count());
+    if (thread == 0) {
+      const double wall = std::chrono::duration<double>(now - start).count();
+      channel->push(phase, METRIC_WALL, -1, wall);
+      if (nnz > 0 & wall > 0) channel->push(phase, METRIC_NNZ_PER_SECOND, -1, nnz / wall);
+    }
+    start = now;
+  }
+
+  void record(MetricPhase phase, MetricType type, double value) {
+    if (channel != NULL) channel->push(phase, type, thread, value);
+  }
+
+};
+
+#endif // __METRICS_H__
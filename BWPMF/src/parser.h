@@ -0,0 +1,186 @@
+#ifndef __PARSER_H__
+#define __PARSER_H__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The largest chunk of the parallel parsers, see `split_lines`.
+#ifndef BWPMF_PARSE_CHUNK_BYTES
+#define BWPMF_PARSE_CHUNK_BYTES (64 << 20)
+#endif
+
+// A range of bytes in the buffer of the caller.
+struct Token {
+
+  const char *data;
+
+  size_t size;
+
+  Token() : data(NULL), size(0) { }
+
+  Token(const char* _data, size_t _size) : data(_data), size(_size) { }
+
+  bool operator==(const Token& src) const {
+    return size == src.size && std::memcmp(data, src.data, size) == 0;
+  }
+
+  // Assigns the token to `buf` and returns it, so a lookup reuses the buffer.
+  const std::string& assign_to(std::string& buf) const {
+    buf.assign(data, size);
+    return buf;
+  }
+
+};
+
+// FNV-1a
+struct TokenHash {
+  size_t operator()(const Token& token) const {
+    uint64_t retval = 14695981039346656037ULL;
+    for(size_t i = 0;i < token.size;i++) {
+      retval = (retval ^ static_cast<unsigned char>(token.data[i])) * 1099511628211ULL;
+    }
+    return retval;
+  }
+};
+
+// A field "hostname\3count" of a line.
+struct Visit {
+
+  Token hostname;
+
+  int count;
+
+  Visit(const Token& _hostname, int _count) : hostname(_hostname), count(_count) { }
+
+};
+
+// The count after \3 like `std::atoi`.
+inline int parse_count(const char* p, const char* end) {
+  for(;p < end && (*p == ' ' | (*p >= '\t' & *p <= '\r'));p++) { }
+  bool negative = false;
+  if (p < end && (*p == '-' | *p == '+')) negative = *p++ == '-';
+  int retval = 0;
+  for(;p < end && *p >= '0' && *p <= '9';p++) {
+    retval = retval * 10 + (*p - '0');
+  }
+  return negative ? -retval : retval;
+}
+
+// Splits the line "cookie\1hostname\3count\2hostname\3count..." in [begin, end)
+// without copying. The cookie is before the first \1, and the fields are the
+// text before the next \1 split by \2. `fields` is the number of the fields,
+// and `visits` are the fields which have a \3 after a nonempty hostname. It
+// returns false if there is no \1.
+inline bool parse_line(const char* begin, const char* end, Token& cookie, std::vector<Visit>& visits, size_t& fields) {
+  const char *delim = static_cast<const char*>(std::memchr(begin, '\1', end - begin));
+  if (delim == NULL) return false;
+  cookie = Token(begin, delim - begin);
+  const char *p = delim + 1, *stop = static_cast<const char*>(std::memchr(p, '\1', end - p));
+  if (stop == NULL) stop = end;
+  visits.clear();
+  fields = 0;
+  while(true) {
+    const char *field_end = static_cast<const char*>(std::memchr(p, '\2', stop - p));
+    if (field_end == NULL) field_end = stop;
+    fields++;
+    const char *comp = static_cast<const char*>(std::memchr(p, '\3', field_end - p));
+    if (comp != NULL && comp > p) visits.push_back(Visit(Token(p, comp - p), parse_count(comp + 1, field_end)));
+    if (field_end == stop) break;
+    p = field_end + 1;
+  }
+  return true;
+}
+
+// Calls `f(begin, end)` for each line in [begin, end) like `std::getline`. It
+// stops once `f` returns false and returns the number of lines.
+template<typename Function>
+size_t for_each_line(const char* begin, const char* end, Function f) {
+  size_t retval = 0;
+  for(const char *p = begin;p < end;) {
+    const char *line_end = static_cast<const char*>(std::memchr(p, '\n', end - p));
+    if (line_end == NULL) line_end = end;
+    retval++;
+    if (!f(p, line_end)) break;
+    p = line_end + 1;
+  }
+  return retval;
+}
+
+// Cuts [data, data + size) into about `chunks` chunks of at most
+// `BWPMF_PARSE_CHUNK_BYTES` bytes. The chunk c is [bound[c], bound[c + 1]), and
+// every chunk but the last ends after a line break.
+inline std::vector<const char*> split_lines(const char* data, size_t size, size_t chunks) {
+  const size_t bytes = std::max<size_t>(std::min<size_t>(size / std::max<size_t>(chunks, 1), BWPMF_PARSE_CHUNK_BYTES), 1);
+  std::vector<const char*> retval(1, data);
+  const char *end = data + size;
+  for(const char *p = data;p < end;) {
+    const char *next = p + std::min<size_t>(bytes, end - p);
+    if (next < end) {
+      const char *line_end = static_cast<const char*>(std::memchr(next - 1, '\n', end - next + 1));
+      next = line_end == NULL ? end : line_end + 1;
+    }
+    retval.push_back(next);
+    p = next;
+  }
+  return retval;
+}
+
+// A read-only mapping of the whole file, which is read ahead sequentially.
+class MappedFile {
+
+  int fd;
+
+  size_t size;
+
+  const char *data;
+
+  MappedFile(const MappedFile&);
+  void operator=(const MappedFile&);
+
+public:
+
+  explicit MappedFile(const std::string& path) : fd(-1), size(0), data(NULL) {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Failed to stat " + path + ": " + strerror(errno));
+    }
+    size = st.st_size;
+    if (size == 0) return;
+    void *p = ::mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      ::close(fd);
+      throw std::runtime_error("Failed to mmap " + path + ": " + strerror(errno));
+    }
+    ::madvise(p, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(p);
+  }
+
+  ~MappedFile() {
+    if (data != NULL) ::munmap(const_cast<char*>(data), size);
+    if (fd >= 0) ::close(fd);
+  }
+
+  const char* get_data() const {
+    return data;
+  }
+
+  const size_t get_size() const {
+    return size;
+  }
+
+};
+
+#endif // __PARSER_H__
@@ -0,0 +1,305 @@
+#ifndef __PHI_CODEC_H__
+#define __PHI_CODEC_H__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+#include "bwpmf.h"
+#include "kernel.h"
+
+// The encoding of the stored phi. A phi is in [0, 1] and its row sums to 1, so
+// it survives a narrower type:
+// - PHI_CODEC_FLOAT: the `DTYPE` itself.
+// - PHI_CODEC_FP16: IEEE half precision, about 3 significant digits.
+// - PHI_CODEC_BF16: the upper half of the float, about 2 significant digits.
+// - PHI_CODEC_Q16, PHI_CODEC_Q8: fixed point, [0, 1] is scaled to the largest
+//   unsigned integer. The absolute error is 1 / 131070 and 1 / 510.
+enum PhiCodecType {
+  PHI_CODEC_FLOAT = 0,
+  PHI_CODEC_FP16 = 1,
+  PHI_CODEC_BF16 = 2,
+  PHI_CODEC_Q16 = 3,
+  PHI_CODEC_Q8 = 4
+};
+
+inline PhiCodecType parse_phi_codec(const std::string& codec) {
+  if (codec.compare("float") == 0) return PHI_CODEC_FLOAT;
+  if (codec.compare("fp16") == 0) return PHI_CODEC_FP16;
+  if (codec.compare("bf16") == 0) return PHI_CODEC_BF16;
+  if (codec.compare("q16") == 0) return PHI_CODEC_Q16;
+  if (codec.compare("q8") == 0) return PHI_CODEC_Q8;
+  throw std::invalid_argument("Unknown codec of phi");
+}
+
+// A component of the sparse phi. The unused entries of a row are zero.
+struct PhiEntry {
+  uint32_t k;
+  DTYPE value;
+};
+
+// round to nearest even, the subnormal halves are kept
+inline uint16_t float_to_half(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000, abs = x & 0x7fffffff;
+  // overflow, infinity or NaN
+  if (abs >= 0x47800000) return sign | (abs > 0x7f800000 ? 0x7e00 : 0x7c00);
+  // the subnormal halves are multiples of 2^-24
+  if (abs < 0x38800000) {
+    float v;
+    std::memcpy(&v, &abs, sizeof(v));
+    return sign | static_cast<uint16_t>(v * 16777216.0f + 0.5f);
+  }
+  uint32_t h = (abs - 0x38000000) >> 13;
+  const uint32_t rest = abs & 0x1fff;
+  if (rest > 0x1000 | (rest == 0x1000 & (h & 1))) h++;
+  return sign | h;
+}
+
+inline float half_to_float(uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+  uint32_t x;
+  if (e == 0) {
+    const float v = m * (1.0f / 16777216.0f);
+    std::memcpy(&x, &v, sizeof(x));
+    x |= sign;
+  } else if (e == 31) {
+    x = sign | 0x7f800000 | (m << 13);
+  } else {
+    x = sign | ((e + 112) << 23) | (m << 13);
+  }
+  float f;
+  std::memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+// Encodes the K-wide rows of phi. The loops have no branch so the compiler
+// vectorizes them, and fp16 uses the F16C instructions if they are enabled,
+// e.g. by `-mf16c` or `-march=native` in ~/.R/Makevars.
+//
+// If `top_m > 0`, a row is sparse: the `top_m` largest phi in `PhiEntry`, or
+// fewer of them if they already hold `mass` of the row, renormalized to sum 
+// to 1. The updates only touch these components, see `axpy`.
+struct PhiCodec {
+
+  PhiCodecType type;
+
+  int top_m;
+
+  DTYPE mass;
+
+  explicit PhiCodec(PhiCodecType _type = PHI_CODEC_FLOAT, int _top_m = 0, DTYPE _mass = 1.0)
+    : type(_type), top_m(_top_m), mass(_mass)
+    { }
+
+  const bool is_float() const {
+    return type == PHI_CODEC_FLOAT & top_m == 0;
+  }
+
+  const bool is_sparse() const {
+    return top_m > 0;
+  }
+
+  // the bytes of one stored phi
+  const size_t entry_size() const {
+    if (is_sparse()) return sizeof(PhiEntry);
+    switch(type) {
+    case PHI_CODEC_FLOAT: return sizeof(DTYPE);
+    case PHI_CODEC_Q8: return sizeof(uint8_t);
+    default: return sizeof(uint16_t);
+    }
+  }
+
+  // the number of stored phi of a row
+  const size_t row_size(const int K) const {
+    return is_sparse() ? top_m : K;
+  }
+
+  const size_t row_bytes(const int K) const {
+    return row_size(K) * entry_size();
+  }
+
+  // Where `Kernel::phi` writes the phi of a stored row: the row itself if it is
+  // float, or the buffer which is encoded into the row by `encode`.
+  DTYPE* target(void* row, DTYPE* buffer) const {
+    return is_float() ? static_cast<DTYPE*>(row) : buffer;
+  }
+
+  // The largest phi are kept sorted by an insertion, which is linear in K when
+  // `top_m` is small.
+  void encode_sparse(const DTYPE* phi, PhiEntry* dst, const int K) const {
+    int size = 0;
+    for(int k = 0;k < K;k++) {
+      if (size == top_m && phi[k] <= dst[size - 1].value) continue;
+      int j = size < top_m ? size++ : size - 1;
+      for(;j > 0 && dst[j - 1].value < phi[k];j--) {
+        dst[j] = dst[j - 1];
+      }
+      dst[j].k = k;
+      dst[j].value = phi[k];
+    }
+    DTYPE sum = 0.0;
+    int kept = 0;
+    while(kept < size && sum < mass) {
+      sum += dst[kept++].value;
+    }
+    // every kept phi underflows to 0: the largest one takes the whole row
+    if (!(sum > 0)) {
+      kept = 1;
+      dst[0].value = 1.0;
+    } else {
+      const DTYPE scale = 1.0 / sum;
+      for(int j = 0;j < kept;j++) {
+        dst[j].value *= scale;
+      }
+    }
+    for(int j = kept;j < top_m;j++) {
+      dst[j].k = 0;
+      dst[j].value = 0.0;
+    }
+  }
+
+  template<int KS>
+  void encode(const DTYPE* phi, void* row, const int _K) const {
+    const int K(Kernel<KS>::width(_K));
+    if (is_sparse()) return encode_sparse(phi, static_cast<PhiEntry*>(row), K);
+    switch(type) {
+    case PHI_CODEC_FLOAT: {
+      if (phi != row) std::memcpy(row, phi, K * sizeof(DTYPE));
+      break;
+    }
+    case PHI_CODEC_FP16: {
+      uint16_t *dst = static_cast<uint16_t*>(row);
+      int k = 0;
+#ifdef __F16C__
+      for(;k + 8 <= K;k += 8) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm256_cvtps_ph(_mm256_loadu_ps(phi + k), _MM_FROUND_TO_NEAREST_INT));
+      }
+#endif
+      for(;k < K;k++) {
+        dst[k] = float_to_half(phi[k]);
+      }
+      break;
+    }
+    case PHI_CODEC_BF16: {
+      uint16_t *dst = static_cast<uint16_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        uint32_t x;
+        std::memcpy(&x, phi + k, sizeof(x));
+        dst[k] = (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+      }
+      break;
+    }
+    case PHI_CODEC_Q16: {
+      uint16_t *dst = static_cast<uint16_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        dst[k] = static_cast<uint16_t>(std::min<DTYPE>(phi[k], 1.0) * 65535.0f + 0.5f);
+      }
+      break;
+    }
+    case PHI_CODEC_Q8: {
+      uint8_t *dst = static_cast<uint8_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        dst[k] = static_cast<uint8_t>(std::min<DTYPE>(phi[k], 1.0) * 255.0f + 0.5f);
+      }
+      break;
+    }
+    }
+  }
+
+  // Returns the phi of the row. A float row is returned as it is and the other
+  // rows are decoded into the buffer.
+  template<int KS>
+  const DTYPE* decode(const void* row, DTYPE* buffer, const int _K) const {
+    const int K(Kernel<KS>::width(_K));
+    if (is_sparse()) {
+      const PhiEntry *src = static_cast<const PhiEntry*>(row);
+      std::fill(buffer, buffer + K, 0.0);
+      for(int j = 0;j < top_m;j++) {
+        buffer[src[j].k] += src[j].value;
+      }
+      return buffer;
+    }
+    switch(type) {
+    case PHI_CODEC_FLOAT: return static_cast<const DTYPE*>(row);
+    case PHI_CODEC_FP16: {
+      const uint16_t *src = static_cast<const uint16_t*>(row);
+      int k = 0;
+#ifdef __F16C__
+      for(;k + 8 <= K;k += 8) {
+        _mm256_storeu_ps(buffer + k, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k))));
+      }
+#endif
+      for(;k < K;k++) {
+        buffer[k] = half_to_float(src[k]);
+      }
+      break;
+    }
+    case PHI_CODEC_BF16: {
+      const uint16_t *src = static_cast<const uint16_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        const uint32_t x = static_cast<uint32_t>(src[k]) << 16;
+        std::memcpy(buffer + k, &x, sizeof(x));
+      }
+      break;
+    }
+    case PHI_CODEC_Q16: {
+      const uint16_t *src = static_cast<const uint16_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        buffer[k] = src[k] * (1.0f / 65535.0f);
+      }
+      break;
+    }
+    case PHI_CODEC_Q8: {
+      const uint8_t *src = static_cast<const uint8_t*>(row);
+#pragma omp simd
+      for(int k = 0;k < K;k++) {
+        buffer[k] = src[k] * (1.0f / 255.0f);
+      }
+      break;
+    }
+    }
+    return buffer;
+  }
+
+  // target[k] += y * phi[k] of the row
+  template<int KS, typename T>
+  void axpy(const DTYPE y, const void* row, DTYPE* buffer, T* target, const int K) const {
+    if (is_sparse()) {
+      const PhiEntry *src = static_cast<const PhiEntry*>(row);
+      for(int j = 0;j < top_m;j++) {
+        target[src[j].k] += y * src[j].value;
+      }
+    } else {
+      Kernel<KS>::axpy(y, decode<KS>(row, buffer, K), target, K);
+    }
+  }
+
+  // target[k] += y * phi[k] of the row where the target is shared with the 
+  // other threads
+  template<int KS>
+  void atomic_axpy(const DTYPE y, const void* row, DTYPE* buffer, DTYPE* target, const int K) const {
+    if (is_sparse()) {
+      const PhiEntry *src = static_cast<const PhiEntry*>(row);
+      for(int j = 0;j < top_m && src[j].value > 0;j++) {
+        const DTYPE tmp = y * src[j].value;
+#pragma omp atomic
+        target[src[j].k] += tmp;
+      }
+    } else {
+      Kernel<KS>::atomic_axpy(y, decode<KS>(row, buffer, K), target, K);
+    }
+  }
+
+};
+
+#endif // __PHI_CODEC_H__
@@ -13,6 +13,8 @@
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/serialization/unordered_map.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/array.hpp>
+#include <boost/serialization/version.hpp>
 #include <Rcpp.h>
 
 template<typename T>
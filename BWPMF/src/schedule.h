@@ -0,0 +1,305 @@
+#ifndef __SCHEDULE_H__
+#define __SCHEDULE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include "list_of_list.h"
+
+// The chunks of each thread, see `ChunkScheduler`.
+#ifndef BWPMF_CHUNKS_PER_THREAD
+#define BWPMF_CHUNKS_PER_THREAD 16
+#endif
+
+// Schedules the rows of a `ListOfList`, e.g. the users of `History.data`, by
+// their nonzeros instead of their count. The rows are cut into chunks of about
+// `nnz / (threads * BWPMF_CHUNKS_PER_THREAD)` nonzeros by the prefix sums of
+// the index, so a heavy user makes a chunk on its own. Each thread owns a
+// contiguous range of chunks of about the same nonzeros and claims them in
+// order with an atomic increment. Once its range is done, the thread steals
+// the remaining chunks of the others in the same way.
+//
+// A scheduled loop is `begin` followed by `next` until it returns false, and
+// it must be called by every thread of the team and end with a barrier. The
+// counters of the loops alternate between two banks: `begin` resets the
+// counter of the thread for the next loop, which nobody touches until the
+// barrier of the current loop. So the loops need no barrier to reset them.
+// `prepare` must be called in a `single` construct of the same team.
+class ChunkScheduler {
+
+  struct Counter {
+    std::atomic<size_t> next;
+    char padding[64 - sizeof(std::atomic<size_t>)];
+  };
+
+  // the state and the load of a thread
+  struct Local {
+    unsigned int round;
+    int victim;
+    size_t chunks, stolen, nnz;
+    char padding[64 - sizeof(unsigned int) - sizeof(int) - 3 * sizeof(size_t)];
+  };
+
+  const void* source;
+
+  size_t total_size;
+
+  int threads;
+
+  // the chunk c is the rows in [bound[c], bound[c + 1])
+  std::vector<size_t> bound, chunk_nnz;
+
+  // the thread t owns the chunks in [first[t], first[t + 1])
+  std::vector<size_t> first;
+
+  std::unique_ptr<Counter[]> counter;
+
+  std::unique_ptr<Local[]> local;
+
+public:
+
+  ChunkScheduler() : source(NULL), total_size(0), threads(0), bound(), chunk_nnz(), first(), counter(), local() { }
+
+  // Forgets the cut, so the next `prepare` redoes it.
+  void reset() {
+    source = NULL;
+  }
+
+  // Cuts the rows of `data` for `threads` threads unless it is already done.
+  template<typename T>
+  void prepare(const ListOfList<T>& data, int _threads) {
+    if (source == &data & total_size == data.get_total_size() & threads == _threads) return;
+    source = &data;
+    total_size = data.get_total_size();
+    threads = _threads;
+    const size_t rows = data.get_index_size();
+    // a row costs its nonzeros and one for itself
+    const size_t total = data.get_total_size() + rows;
+    const size_t target = std::max<size_t>(total / (threads * BWPMF_CHUNKS_PER_THREAD), 1);
+    bound.assign(1, 0);
+    chunk_nnz.clear();
+    size_t cost = 0;
+    for(size_t row = 0;row < rows;row++) {
+      cost += data.offset(row + 1) - data.offset(row) + 1;
+      if (cost >= target | row + 1 == rows) {
+        bound.push_back(row + 1);
+        chunk_nnz.push_back(data.offset(row + 1) - data.offset(bound[bound.size() - 2]));
+        cost = 0;
+      }
+    }
+    // the owner of a chunk is decided by the cost before its middle
+    const size_t chunks = chunk_nnz.size();
+    first.assign(threads + 1, chunks);
+    first[0] = 0;
+    size_t before = 0;
+    int owner = 0;
+    for(size_t c = 0;c < chunks;c++) {
+      const size_t weight = chunk_nnz[c] + bound[c + 1] - bound[c];
+      const int t = std::min<size_t>((before + weight / 2) * threads / total, threads - 1);
+      for(;owner < t;owner++) first[owner + 1] = c;
+      before += weight;
+    }
+    counter.reset(new Counter[2 * threads]);
+    local.reset(new Local[threads]);
+    for(int t = 0;t < threads;t++) {
+      counter[t].next = first[t];
+      counter[threads + t].next = first[t];
+      local[t].round = 0;
+      local[t].victim = t;
+    }
+    reset_load();
+  }
+
+  void begin(int thread_id) {
+    Local& state(local[thread_id]);
+    state.round++;
+    state.victim = thread_id;
+    counter[(state.round & 1) * threads + thread_id].next = first[thread_id];
+  }
+
+  // Claims the next chunk of the thread, which is the rows in [row_begin, row_end).
+  bool next(int thread_id, size_t& row_begin, size_t& row_end) {
+    Local& state(local[thread_id]);
+    Counter* bank = counter.get() + ((state.round + 1) & 1) * threads;
+    for(int tried = 0;tried < threads;tried++) {
+      const int victim = state.victim;
+      if (bank[victim].next.load(std::memory_order_relaxed) < first[victim + 1]) {
+        const size_t c = bank[victim].next.fetch_add(1, std::memory_order_relaxed);
+        if (c < first[victim + 1]) {
+          row_begin = bound[c];
+          row_end = bound[c + 1];
+          state.chunks++;
+          state.nnz += chunk_nnz[c];
+          if (victim != thread_id) state.stolen++;
+          return true;
+        }
+      }
+      state.victim = (victim + 1) % threads;
+    }
+    return false;
+  }
+
+  const int get_threads() const {
+    return threads;
+  }
+
+  const size_t get_chunk_size() const {
+    return chunk_nnz.size();
+  }
+
+  // The chunks, the stolen chunks and the nonzeros claimed by the thread since
+  // the last reset.
+  const size_t get_chunks(int thread_id) const {
+    return local[thread_id].chunks;
+  }
+
+  const size_t get_stolen(int thread_id) const {
+    return local[thread_id].stolen;
+  }
+
+  const size_t get_nnz(int thread_id) const {
+    return local[thread_id].nnz;
+  }
+
+  void reset_load() {
+    for(int t = 0;t < threads;t++) {
+      local[t].chunks = 0;
+      local[t].stolen = 0;
+      local[t].nnz = 0;
+    }
+  }
+
+};
+
+// The bytes of the item rows touched by a tile, see `TileScheduler`.
+#ifndef BWPMF_TILE_BYTES
+#define BWPMF_TILE_BYTES (1 << 20)
+#endif
+
+// Partitions the nonzeros of a user-major `ListOfList` into a grid of user 
+// blocks x item blocks. There is one user block per thread, cut by the 
+// nonzeros like `ChunkScheduler`, and the items are cut into blocks of equal 
+// size whose rows of `item_bytes` fit in `BWPMF_TILE_BYTES`. The number of 
+// item blocks is a multiple of the threads.
+//
+// The row of a user is split into the runs of consecutive nonzeros in the same
+// item block, and a tile is the runs of its users. If the items of each row 
+// are sorted, e.g. by `permute_history`, a user has at most one run per tile.
+// Otherwise there may be a run per nonzero, so the tiles take at most 12 bytes
+// per nonzero, 1.5 times the 8 bytes of a nonzero of the history.
+//
+// A tiled loop runs `get_strata` strata. In the stratum s, the thread t
+// processes the tile of its user block and the item block 
+// `(s + t * get_stride()) % get_strata()`, so no two threads touch the same
+// items or users in a stratum and they can update them without atomics as long
+// as the strata are separated by barriers. `prepare` must be called in a 
+// `single` construct of the same team.
+class TileScheduler {
+
+public:
+
+  // The nonzeros in [begin, end) of the row of the user `user_begin + user`,
+  // where `user_begin` is the first user of the block of the tile.
+  struct Segment {
+    uint32_t user, begin, end;
+  };
+
+private:
+
+  const void* source;
+
+  size_t total_size, item_size, item_bytes;
+
+  int threads;
+
+  size_t block_items, stride;
+
+  // the user block b is the users in [user_bound[b], user_bound[b + 1])
+  std::vector<size_t> user_bound;
+
+  // the tile of the user block b and the item block c is tile[b * strata + c]
+  std::vector<std::vector<Segment> > tile;
+
+public:
+
+  TileScheduler() : source(NULL), total_size(0), item_size(0), item_bytes(0), threads(0),
+    block_items(1), stride(0), user_bound(), tile() { }
+
+  // Forgets the cut, so the next `prepare` redoes it.
+  void reset() {
+    source = NULL;
+  }
+
+  // Cuts the nonzeros of `data` for `threads` threads unless it is already done.
+  template<typename T>
+  void prepare(const ListOfList<T>& data, size_t _item_size, size_t _item_bytes, int _threads) {
+    if (source == &data & total_size == data.get_total_size() & item_size == _item_size & 
+        item_bytes == _item_bytes & threads == _threads) return;
+    source = &data;
+    total_size = data.get_total_size();
+    item_size = _item_size;
+    item_bytes = _item_bytes;
+    threads = _threads;
+    const size_t cache_items = std::max<size_t>(BWPMF_TILE_BYTES / item_bytes, 1);
+    stride = std::max<size_t>((item_size + cache_items * threads - 1) / (cache_items * threads), 1);
+    const size_t strata = stride * threads;
+    block_items = std::max<size_t>((item_size + strata - 1) / strata, 1);
+    // a row costs its nonzeros and one for itself
+    const size_t rows = data.get_index_size(), total = total_size + rows;
+    user_bound.assign(threads + 1, rows);
+    user_bound[0] = 0;
+    int block = 0;
+    for(size_t row = 0;row < rows;row++) {
+      const size_t before = data.offset(row) + row;
+      for(;block + 1 < threads & before * threads >= (block + 1) * total;block++) user_bound[block + 1] = row;
+    }
+    tile.assign(threads * strata, std::vector<Segment>());
+    for(int b = 0;b < threads;b++) {
+      std::vector<Segment>* local_tile = &tile[b * strata];
+      for(size_t row = user_bound[b];row < user_bound[b + 1];row++) {
+        const T* start = data(row);
+        const uint32_t size = data.size(row);
+        for(uint32_t j = 0;j < size;) {
+          const size_t c = start[j].item / block_items;
+          Segment segment = { static_cast<uint32_t>(row - user_bound[b]), j, j + 1 };
+          for(;segment.end < size && start[segment.end].item / block_items == c;segment.end++) { }
+          local_tile[c].push_back(segment);
+          j = segment.end;
+        }
+      }
+    }
+  }
+
+  const int get_threads() const {
+    return threads;
+  }
+
+  const size_t get_strata() const {
+    return stride * threads;
+  }
+
+  const size_t get_stride() const {
+    return stride;
+  }
+
+  // The users of the block of the thread are in [user_begin, user_end).
+  const size_t user_begin(int thread_id) const {
+    return user_bound[thread_id];
+  }
+
+  const size_t user_end(int thread_id) const {
+    return user_bound[thread_id + 1];
+  }
+
+  const std::vector<Segment>& get(int thread_id, size_t stratum) const {
+    const size_t strata = get_strata();
+    return tile[thread_id * strata + (stratum + thread_id * stride) % strata];
+  }
+
+};
+
+#endif // __SCHEDULE_H__
@@ -6,7 +6,13 @@
 #include <boost/format.hpp>
 #include "rcpp_serialization.h"
 #include "list_of_list.h"
+#include "parser.h"
+#include "aligned_array.h"
 #include "bwpmf.h"
+#include "kernel.h"
+#include "phi_codec.h"
+#include "metrics.h"
+#include "schedule.h"
 #include "train.h"
 #include "omp.h"
 
@@ -0,0 +1,362 @@
+#include <set>
+#include <random>
+#include "stdafx.h"
+
+using namespace Rcpp;
+
+RCPP_EXPOSED_CLASS(Model)
+
+// A mini-batch of users: the nonzeros of `users[b]` are `data` in
+// [offset[b], offset[b + 1]).
+struct SviBatch {
+  std::vector<size_t> users, offset;
+  std::vector<ItemCount> data;
+
+  void clear() {
+    users.clear();
+    offset.assign(1, 0);
+    data.clear();
+  }
+
+  void push_back(size_t user) {
+    users.push_back(user);
+    offset.push_back(data.size());
+  }
+};
+
+// The items seen by the local updates of the users: exp(E[log(beta)]) and 
+// sum_i(E[beta_i]).
+template<int KS>
+struct LocalItems {
+
+  AlignedArray<DTYPE> exp_elog;
+
+  std::vector<double> sum;
+
+  explicit LocalItems(const Model& model) : exp_elog(model.item_size * model.K), sum(model.K, 0.0) {
+    const int K(model.K);
+#pragma omp parallel
+    {
+      std::vector<double> local_sum(K, 0.0);
+#pragma omp for
+      for(size_t item = 0;item < model.item_size;item++) {
+        ConstParamView item_param(model.item_param[item]);
+        DTYPE *target = exp_elog.get() + item * K;
+        for(int k = 0;k < K;k++) {
+          target[k] = exp(Rf_digamma(item_param.shp1[k])) / item_param.rte1[k];
+        }
+        Kernel<KS>::mean(item_param.shp1, item_param.rte1, &local_sum[0], K);
+      }
+#pragma omp critical
+      for(int k = 0;k < K;k++) {
+        sum[k] += local_sum[k];
+      }
+    }
+  }
+
+};
+
+// The coordinate ascent of a user and its phi against fixed items, with the
+// buffers of a thread.
+template<int KS>
+class LocalUser {
+
+  const Prior& prior;
+
+  const int K;
+
+  AlignedArray<DTYPE> exp_elog, phi;
+
+  std::vector<double> shp1;
+
+public:
+
+  LocalUser(const Prior& _prior, int _K) : prior(_prior), K(_K), exp_elog(_K), phi(_K), shp1(_K) { }
+
+  // Updates the user of the nonzeros in [start, end) `iterations` times. If 
+  // `item_stat` is not NULL, the `y * phi` of the last round are added to it.
+  void fit(ParamView user_param, const ItemCount* start, const ItemCount* end, const LocalItems<KS>& items, 
+           int iterations, DTYPE* item_stat) {
+    for(int iteration = 0;iteration < iterations;iteration++) {
+      const bool last = iteration + 1 == iterations;
+      for(int k = 0;k < K;k++) {
+        exp_elog[k] = exp(Rf_digamma(user_param.shp1[k])) / user_param.rte1[k];
+      }
+      std::fill(shp1.begin(), shp1.end(), prior.a1);
+      for(const ItemCount *pitem_count = start;pitem_count != end;pitem_count++) {
+        Kernel<KS>::phi(exp_elog.get(), items.exp_elog.get() + pitem_count->item * K, phi.get(), K);
+        Kernel<KS>::axpy(pitem_count->count, phi.get(), &shp1[0], K);
+        if (last & item_stat != NULL) Kernel<KS>::atomic_axpy(pitem_count->count, phi.get(), item_stat + pitem_count->item * K, K);
+      }
+      const double user_activity = user_param.shp2 / user_param.rte2;
+      std::copy(shp1.begin(), shp1.end(), user_param.shp1);
+      std::transform(items.sum.begin(), items.sum.end(), user_param.rte1, [user_activity](const double input) {
+        return input + user_activity;
+      });
+      user_param.rte2 = prior.a2 / prior.b2;
+      for(int k = 0;k < K;k++) {
+        user_param.rte2 += user_param.shp1[k] / user_param.rte1[k];
+      }
+    }
+  }
+
+};
+
+// Stochastic variational inference (Hoffman et al. 2013) of the model. A step
+// takes a mini-batch of users, which are the local variables: the phi and the
+// parameters of each user are updated `local_iterations` times against the
+// current items. Then the items, which are the global variables, move toward
+// their coordinate ascent update estimated from the batch as if it were
+// repeated `user_size / batch size` times, with the Robbins-Monro step size
+// `rho = (tau0 + t)^(-kappa)` of the step t = 0, 1, ... of the model. `tau0`
+// should be positive, or the first step would be infinite.
+//
+// The phi of the batch is never stored, and the statistics of the items are
+// kept in `item_size x K` buffers, so the memory is the model and the batch.
+template<int KS>
+class SviTrainer {
+
+  Model& model;
+
+  const int K;
+
+  double tau0, kappa;
+
+  int local_iterations;
+
+  size_t& steps;
+
+  LocalItems<KS> items;
+
+  // sum_i(y phi) of the batch
+  AlignedArray<DTYPE> item_stat;
+
+public:
+
+  SviTrainer(Model& _model, double _tau0, double _kappa, int _local_iterations)
+    : model(_model), K(_model.K), tau0(_tau0), kappa(_kappa), local_iterations(_local_iterations),
+    steps(get_train_context(_model).svi_steps), items(_model), item_stat(_model.item_size * _model.K) {
+    if (tau0 <= 0) throw std::invalid_argument("tau0 should be positive");
+    if (kappa <= 0.5 | kappa > 1) throw std::invalid_argument("kappa should be in (0.5, 1]");
+    if (local_iterations < 1) throw std::invalid_argument("local_iterations should be positive");
+    std::fill(item_stat.get(), item_stat.get() + model.item_size * K, 0.0);
+  }
+
+  // Returns the step size of the batch.
+  double step(const SviBatch& batch) {
+    const size_t batch_size = batch.users.size();
+    if (batch_size == 0) return 0.0;
+    const double rho = std::pow(tau0 + steps, -kappa), scale = static_cast<double>(model.user_size) / batch_size;
+    std::vector<double> user_sum(K, 0.0);
+#pragma omp parallel
+    {
+      std::vector<double> local_sum(K, 0.0);
+      LocalUser<KS> local_user(model.prior, K);
+#pragma omp for schedule(dynamic, 16)
+      for(size_t b = 0;b < batch_size;b++) {
+        ParamView user_param(model.user_param[batch.users[b]]);
+        local_user.fit(user_param, batch.data.data() + batch.offset[b], batch.data.data() + batch.offset[b + 1], items, 
+                       local_iterations, item_stat.get());
+        Kernel<KS>::mean(user_param.shp1, user_param.rte1, &local_sum[0], K);
+      }
+#pragma omp critical
+      for(int k = 0;k < K;k++) {
+        user_sum[k] += local_sum[k];
+      }
+#pragma omp barrier
+#pragma omp single
+      std::fill(items.sum.begin(), items.sum.end(), 0.0);
+      std::fill(local_sum.begin(), local_sum.end(), 0.0);
+#pragma omp for
+      for(size_t item = 0;item < model.item_size;item++) {
+        ParamView item_param(model.item_param[item]);
+        DTYPE *stat = item_stat.get() + item * K, *target = items.exp_elog.get() + item * K;
+        const double item_activity = item_param.shp2 / item_param.rte2;
+        double rte2 = model.prior.c2 / model.prior.d2;
+        for(int k = 0;k < K;k++) {
+          item_param.shp1[k] = (1 - rho) * item_param.shp1[k] + rho * (model.prior.c1 + scale * stat[k]);
+          item_param.rte1[k] = (1 - rho) * item_param.rte1[k] + rho * (item_activity + scale * user_sum[k]);
+          stat[k] = 0.0;
+          rte2 += item_param.shp1[k] / item_param.rte1[k];
+          target[k] = exp(Rf_digamma(item_param.shp1[k])) / item_param.rte1[k];
+        }
+        item_param.rte2 = (1 - rho) * item_param.rte2 + rho * rte2;
+        Kernel<KS>::mean(item_param.shp1, item_param.rte1, &local_sum[0], K);
+      }
+#pragma omp critical
+      for(int k = 0;k < K;k++) {
+        items.sum[k] += local_sum[k];
+      }
+    }
+    steps++;
+    return rho;
+  }
+
+};
+
+// Samples `size` distinct users of `history` uniformly (Floyd's algorithm) in
+// the increasing order.
+void sample_batch(const History& history, size_t size, std::mt19937_64& rng, SviBatch& batch) {
+  std::set<size_t> users;
+  for(size_t j = history.user_size - size;j < history.user_size;j++) {
+    const size_t t = std::uniform_int_distribution<size_t>(0, j)(rng);
+    if (!users.insert(t).second) users.insert(j);
+  }
+  batch.clear();
+  for(size_t user : users) {
+    const auto range = history.data.range(user);
+    batch.data.insert(batch.data.end(), range.first, range.second);
+    batch.push_back(user);
+  }
+}
+
+// Reads the next `size` users of the text file of `encode`. The cookies and the
+// hostnames which are not in the dictionaries are skipped. `visits` is the
+// parse buffer of the caller. It returns false at the end of the file.
+bool read_batch(std::istream& input, size_t size, SviBatch& batch, std::vector<Visit>& visits) {
+  Token cookie;
+  size_t fields;
+  batch.clear();
+  for(std::string str, buf;batch.users.size() < size && std::getline(input, str);) {
+    if (!parse_line(str.data(), str.data() + str.size(), cookie, visits, fields)) throw std::logic_error("invalid data");
+    auto itor_cookie = cookie_dict.find(cookie.assign_to(buf));
+    if (itor_cookie == cookie_dict.end()) continue;
+    for(const Visit& visit : visits) {
+      auto itor_hostname = hostname_dict.find(visit.hostname.assign_to(buf));
+      if (itor_hostname != hostname_dict.end()) batch.data.push_back(ItemCount(itor_hostname->second, visit.count));
+    }
+    batch.push_back(itor_cookie->second);
+  }
+  return batch.users.size() > 0;
+}
+
+template<int KS, typename Next>
+DataFrame svi_loop(Model& model, double tau0, double kappa, int local_iterations, Next next) {
+  typedef std::chrono::steady_clock Clock;
+  SviTrainer<KS> trainer(model, tau0, kappa, local_iterations);
+  std::vector<int> step;
+  std::vector<double> users, nnz, rho, seconds, throughput;
+  SviBatch batch;
+  for(Clock::time_point start = Clock::now();next(batch);start = Clock::now()) {
+    step.push_back(get_train_context(model).svi_steps + 1);
+    rho.push_back(trainer.step(batch));
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    users.push_back(batch.users.size());
+    nnz.push_back(batch.data.size());
+    seconds.push_back(elapsed);
+    throughput.push_back(batch.users.size() / elapsed);
+    checkUserInterrupt();
+  }
+  return DataFrame::create(Named("step") = wrap(step), Named("users") = wrap(users), Named("nnz") = wrap(nnz),
+    Named("rho") = wrap(rho), Named("seconds") = wrap(seconds), Named("users_per_second") = wrap(throughput));
+}
+
+template<int KS>
+DataFrame svi_train(Model& model, const History& history, size_t batch_size, int steps, double tau0, double kappa, 
+                    int local_iterations, std::mt19937_64& rng) {
+  int step = 0;
+  return svi_loop<KS>(model, tau0, kappa, local_iterations, [&](SviBatch& batch) -> bool {
+    if (step++ == steps) return false;
+    sample_batch(history, batch_size, rng, batch);
+    return true;
+  });
+}
+
+// Trains the model with `steps` steps of the stochastic variational inference,
+// see `SviTrainer`. Each step samples `batch_size` users of `Rhistory` without
+// replacement. The step size continues from the previous calls on the model.
+// It returns the trace of the steps with the throughput in users per second.
+//[[Rcpp::export]]
+DataFrame svi_train(SEXP Rmodel, SEXP Rhistory, int batch_size, int steps, double tau0 = 1, double kappa = 0.7, 
+                    int local_iterations = 5, double seed = 0) {
+  Model& model(*as<Model*>(Rmodel));
+  const History& history(*XPtr<History>(Rhistory));
+  if (history.user_size != model.user_size | history.item_size != model.item_size) throw std::invalid_argument("The history is inconsistent with the model");
+  if (batch_size < 1) throw std::invalid_argument("batch_size should be positive");
+  if (steps < 0) throw std::invalid_argument("steps should be non-negative");
+  std::mt19937_64 rng(static_cast<uint64_t>(seed));
+  const size_t size = std::min<size_t>(batch_size, history.user_size);
+  BWPMF_DISPATCH_K(model.K, svi_train, model, history, size, steps, tau0, kappa, local_iterations, rng)
+}
+
+template<int KS>
+DataFrame svi_stream(Model& model, const std::string& path, size_t batch_size, int epochs, double tau0, double kappa, 
+                     int local_iterations) {
+  std::ifstream input;
+  std::vector<Visit> visits;
+  int epoch = 0;
+  return svi_loop<KS>(model, tau0, kappa, local_iterations, [&](SviBatch& batch) -> bool {
+    while(!input.is_open() || !read_batch(input, batch_size, batch, visits)) {
+      if (input.is_open()) input.close();
+      if (epoch++ == epochs) return false;
+      input.open(path.c_str());
+      if (!input) throw std::runtime_error("Failed to open " + path);
+    }
+    return true;
+  });
+}
+
+// Trains the model like `svi_train` with the users streamed from the text file
+// of `encode` in mini-batches of `batch_size` users, `epochs` times. Only the
+// batch is in memory. The cookies and hostnames must be in the dictionaries of 
+// the model, the others are skipped. The users are visited in the order of the
+// file instead of a random sample, so the file should be shuffled.
+//[[Rcpp::export]]
+DataFrame svi_stream(SEXP Rmodel, const std::string& path, int batch_size, int epochs = 1, double tau0 = 1, 
+                     double kappa = 0.7, int local_iterations = 5) {
+  Model& model(*as<Model*>(Rmodel));
+  if (cookie_dict.size() != model.user_size | hostname_dict.size() != model.item_size) throw std::invalid_argument("The dictionaries are inconsistent with the model");
+  if (batch_size < 1) throw std::invalid_argument("batch_size should be positive");
+  if (epochs < 0) throw std::invalid_argument("epochs should be non-negative");
+  BWPMF_DISPATCH_K(model.K, svi_stream, model, path, batch_size, epochs, tau0, kappa, local_iterations)
+}
+
+template<int KS>
+SEXP fold_in(const Model& model, const History& history, int iterations) {
+  std::unique_ptr<Model> retval(new Model());
+  Model& folded(*retval);
+  const int K(model.K);
+  folded.K = K;
+  folded.prior = model.prior;
+  folded.user_size = history.user_size;
+  folded.item_size = model.item_size;
+  folded.user_param = ParamBlock(K, history.user_size);
+  folded.item_param = model.item_param;
+  const LocalItems<KS> items(model);
+  ChunkScheduler scheduler;
+#pragma omp parallel
+  {
+    const int thread_id = omp_get_thread_num();
+    LocalUser<KS> local_user(model.prior, K);
+#pragma omp single
+    scheduler.prepare(history.data, omp_get_num_threads());
+    scheduler.begin(thread_id);
+    for(size_t chunk_begin, chunk_end;scheduler.next(thread_id, chunk_begin, chunk_end);) {
+      for(size_t user = chunk_begin;user < chunk_end;user++) {
+        ParamView user_param(folded.user_param[user]);
+        user_param.shp2 = model.prior.a2 + K * model.prior.a1;
+        user_param.rte2 = model.prior.a2 / model.prior.b2;
+        std::fill(user_param.shp1, user_param.shp1 + K, model.prior.a1);
+        std::fill(user_param.rte1, user_param.rte1 + K, model.prior.b2);
+        const auto range = history.data.range(user);
+        local_user.fit(user_param, range.first, range.second, items, iterations, NULL);
+      }
+    }
+  }
+  return Rcpp::internal::make_new_object(retval.release());
+}
+
+// Infers the users of `Rhistory`, e.g. the new cookies of a day, with the items
+// of the model fixed. Each user starts from the mean of the initialization of
+// `Model` and runs `iterations` rounds of the coordinate ascent of its phi and
+// parameters. The history must share the items of the model. It returns a new
+// model of the users of the history and the items of the model, so the users 
+// can be scored or exported without touching the model.
+//[[Rcpp::export]]
+SEXP fold_in(SEXP Rmodel, SEXP Rhistory, int iterations = 10) {
+  const Model& model(*as<Model*>(Rmodel));
+  const History& history(*XPtr<History>(Rhistory));
+  if (history.item_size != model.item_size) throw std::invalid_argument("The items of the history are inconsistent with the model");
+  if (iterations < 1) throw std::invalid_argument("iterations should be positive");
+  BWPMF_DISPATCH_K(model.K, fold_in, model, history, iterations)
+}
@@ -83,6 +83,16 @@ void test_list_of_list() {
       if (start[i] > 2) report_error(a2, __FILE__, __LINE__);
     }
   }  
+  {
+    LOLI a2(a, true);
+    Rcout << "Testing 64-bit offsets" << std::endl;
+    if (!a2.is_wide() | LOLI(a).is_wide()) report_error(a2, __FILE__, __LINE__);
+    if (a2.offset(1) != 3 | a2.offset(3) != 8 | a2.upper_bound(4) != 2) report_error(a2, __FILE__, __LINE__);
+    a2.clean([](const int& j) {
+      return j < 3;
+    });
+    if (a2.size(0) != 2 | a2.size(1) != 2 | a2.size(2) != 1) report_error(a2, __FILE__, __LINE__);
+  }
   
   
 }
@@ -92,25 +102,26 @@ void test_phi(SEXP Rphi, SEXP Rhistory) {
   {
     RObject phi(Rphi);
     const std::string storage(as<std::string>(phi.attr("storage")));
-    if (storage.compare("memory") != 0) return;
+    if (storage.compare("memory") != 0 & storage.compare("mmap") != 0) return;
   }
   PhiList &phi_list(*XPtr<PhiList>(Rphi));
   History &history(*XPtr<History>(Rhistory));
   if (phi_list.get_index_size() != history.data.get_index_size()) throw std::logic_error(
     boost::str(boost::format("index_size of phi (%1%) and history (%2%) are inconsistent") % phi_list.get_index_size() % history.data.get_index_size())
   );
-  const size_t *phi_index = phi_list.get_index(), *history_index = history.data.get_index();
+  const size_t *phi_index = phi_list.get_index();
   for(size_t i = 0;i < phi_list.get_index_size();i++) {
-    if (phi_index[i] != history_index[i]) throw std::logic_error(boost::str(
-      boost::format("index value of phi (%1%) and history (%2%) are inconsistent ant position %3%)") % phi_index[i] % history_index[i] % i
+    if (phi_index[i] != history.data.offset(i)) throw std::logic_error(boost::str(
+      boost::format("index value of phi (%1%) and history (%2%) are inconsistent ant position %3%)") % phi_index[i] % history.data.offset(i) % i
     ));
   }
 }
 
 template<typename T>
-void print_list_of_list_index(const ListOfList<T>& src) {
-  std::ostream_iterator<size_t> it(Rcpp::Rcout, ", ");
-  std::copy(src.get_index(), src.get_index() + src.get_index_size(), it);
+void print_list_of_list_index(const T& src) {
+  for(size_t i = 0;i < src.get_index_size();i++) {
+    Rcpp::Rcout << src.offset(i) << ", ";
+  }
   Rcpp::Rcout << std::endl;
 }
 
@@ -118,7 +129,8 @@ void print_list_of_list_index(const ListOfList<T>& src) {
 void print_phi_index(SEXP Rphi) {
   {
     RObject phi(Rphi);
-    if (as<std::string>(phi.attr("storage")).compare("memory") != 0) return;
+    const std::string storage(as<std::string>(phi.attr("storage")));
+    if (storage.compare("memory") != 0 & storage.compare("mmap") != 0) return;
   }
   PhiList &phi_list(*XPtr<PhiList>(Rphi));
   return print_list_of_list_index(phi_list);
@@ -134,16 +146,14 @@ NumericMatrix dump_phi_memory(SEXP Rphi) {
   XPtr<PhiList> pphi_list(Rphi);
   const PhiList& phi_list(*pphi_list);
   size_t total_size = phi_list.get_total_size();
-  NumericMatrix retval(total_size, Param::K);
-  size_t j = 0;
-  for(size_t user = 0;user < phi_list.get_index_size();user++) {
-    const auto& user_range(phi_list.range(user));
-    for(auto p = user_range.first;p != user_range.second;p++) {
-      const Phi& phi(*p);
-      for(int k = 0;k < Param::K;k++) {
-        retval(j, k) = phi.data[k];
-      }
-      j++;
+  const int K(phi_list.get_K());
+  NumericMatrix retval(total_size, K);
+  std::vector<DTYPE> buffer(K);
+  const unsigned char* row = phi_list.get_data();
+  for(size_t j = 0;j < total_size;j++, row += phi_list.get_row_bytes()) {
+    const DTYPE *phi = phi_list.get_codec().decode<0>(row, &buffer[0], K);
+    for(int k = 0;k < K;k++) {
+      retval(j, k) = phi[k];
     }
   }
   return retval;
@@ -182,15 +192,19 @@ NumericMatrix dump_phi_disk(SEXP Rphi, SEXP Rhistory, int K) {
         for(const ItemCount *pitem_count = item_range.first; pitem_count != item_range.second;pitem_count++) {
           // size_t item = pitem_count->item;
           std::vector<double> element(K, 0);
-          const Phi& phi(phi_disk.get_read_target());
+          std::vector<DTYPE> buffer(K);
+          const DTYPE *phi = phi_disk.get_codec().decode<0>(phi_disk.get_read_target(), &buffer[0], K);
           for(int k = 0;k < K;k++) {
-            element[k] = phi.data[k];
+            element[k] = phi[k];
           }
           retval_element.push_back(element);
         }
       }
     }
   }
+  for(auto& phi_disk : phi_disk_vec) {
+    phi_disk->check_error();
+  }
   NumericMatrix retval(total_size, K);
   size_t i = 0;
   for(const auto& retval_element : retval_buffer) {
@@ -208,10 +222,12 @@ NumericMatrix dump_phi_disk(SEXP Rphi, SEXP Rhistory, int K) {
 NumericMatrix dump_phi(SEXP Rphi, SEXP Rhistory = R_NilValue, SEXP K = R_NilValue) {
   RObject phi(Rphi);
   const std::string storage(as<std::string>(phi.attr("storage")));
-  if (storage.compare("memory") == 0) {
+  if (storage.compare("memory") == 0 | storage.compare("mmap") == 0) {
     return dump_phi_memory(Rphi);
   } else if (storage.compare("disk") == 0) {
     return dump_phi_disk(Rphi, Rhistory, as<int>(K));
+  } else if (storage.compare("fused") == 0) {
+    throw std::invalid_argument("The fused storage does not keep phi");
   } else {
     throw std::invalid_argument("Unknown storage type");
   }
@@ -219,18 +235,18 @@ NumericMatrix dump_phi(SEXP Rphi, SEXP Rhistory = R_NilValue, SEXP K = R_NilValu
 
 //[[Rcpp::export]]
 SEXP test_phi_on_disk(const std::string& path, NumericMatrix value) {
-  Param::set_K(value.ncol());
-  PhiOnDisk phi_disk(path, 10);
+  PhiOnDisk phi_disk(path, value.ncol(), 10 * value.ncol() * sizeof(DTYPE));
   // write
   {
     auto write_flag(phi_disk.get_write_flag());
     for(size_t i = 0;i < value.nrow();i++) {
-      Phi& phi(phi_disk.get_write_target());
+      DTYPE *phi = static_cast<DTYPE*>(phi_disk.get_write_target());
       for(int k = 0;k < value.ncol();k++) {
-        phi.data[k] = (float) value(i,k);
+        phi[k] = (float) value(i,k);
       }
     }
   }
+  phi_disk.check_error();
   if (value.nrow() != phi_disk.get_total_size()) {
     Rcout << "value.nrow(): " << value.nrow() << " phi_disk.get_total_size(): " << phi_disk.get_total_size() << std::endl;
     throw std::logic_error("total size is incorrect");
@@ -240,9 +256,9 @@ SEXP test_phi_on_disk(const std::string& path, NumericMatrix value) {
   {
     auto read_flag(phi_disk.get_read_flag());
     for(size_t i = 0;i < value.nrow();i++) {
-      const Phi& phi(phi_disk.get_read_target());
+      const DTYPE *phi = static_cast<const DTYPE*>(phi_disk.get_read_target());
       for(int k = 0;k < value.ncol();k++) {
-        retval1(i, k) = phi.data[k];
+        retval1(i, k) = phi[k];
       }
     }
   }
@@ -250,12 +266,13 @@ SEXP test_phi_on_disk(const std::string& path, NumericMatrix value) {
   {
     auto write_flag(phi_disk.get_write_flag());
     for(size_t i = 0;i < value.nrow();i++) {
-      Phi& phi(phi_disk.get_write_target());
+      DTYPE *phi = static_cast<DTYPE*>(phi_disk.get_write_target());
       for(int k = 0;k < value.ncol();k++) {
-        phi.data[k] = (float) value(i,k) + 1;
+        phi[k] = (float) value(i,k) + 1;
       }
     }
   }
+  phi_disk.check_error();
   if (value.nrow() != phi_disk.get_total_size()) throw std::logic_error("total size is incorrect");
   NumericMatrix retval2(value.nrow(), value.ncol());
   // read again
@@ -263,11 +280,12 @@ SEXP test_phi_on_disk(const std::string& path, NumericMatrix value) {
   {
     auto read_flag(phi_disk.get_read_flag());
     for(size_t i = 0;i < value.nrow();i++) {
-      const Phi& phi(phi_disk.get_read_target());
+      const DTYPE *phi = static_cast<const DTYPE*>(phi_disk.get_read_target());
       for(int k = 0;k < value.ncol();k++) {
-        retval2(i, k) = phi.data[k];
+        retval2(i, k) = phi[k];
       }
     }
   }
+  phi_disk.check_error();
   return List::create(Named("retval1") = retval1, Named("retval2") = retval2);
 }
\ No newline at end of file
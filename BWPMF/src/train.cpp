@@ -4,17 +4,48 @@ using namespace Rcpp;
 
 RCPP_EXPOSED_CLASS(Model)
 
+// `codec` encodes the stored phi. If `top_m > 0`, the phi of a nonzero is 
+// sparse and keeps at most its `top_m` largest components, or fewer of them if 
+// they hold `mass`, see `PhiCodec`. A sparse row takes `top_m` entries of 
+// (k, value), so it is smaller than the dense row only if `top_m < K / 2`.
 //[[Rcpp::export]]
-SEXP init_phi(SEXP Rmodel, SEXP Rhistory, const std::string& cached_file = "", int cache_size = 10000) {
+SEXP init_phi(SEXP Rmodel, SEXP Rhistory, const std::string& cached_file = "", double cache_bytes = 16777216, const std::string& storage = "", int cache_buffers = 2, const std::string& codec = "float", int top_m = 0, double mass = 1.0) {
   Model* pmodel(as<Model*>(Rmodel));
   Model& model(*pmodel);
-  if (cached_file.compare("") == 0) {
+  if (top_m < 0 | top_m > model.K) throw std::invalid_argument("top_m should be between 0 and K");
+  if (mass <= 0 | mass > 1) throw std::invalid_argument("mass should be in (0, 1]");
+  if (mass < 1 & top_m == 0) throw std::invalid_argument("mass < 1 requires top_m");
+  if (top_m > 0 & codec.compare("float") != 0) throw std::invalid_argument("The sparse phi is stored as float");
+  const PhiCodec phi_codec(parse_phi_codec(codec), top_m, mass);
+  if (phi_codec.is_sparse() & phi_codec.row_bytes(model.K) >= model.K * sizeof(DTYPE)) {
+    Rf_warning("The sparse phi of top_m = %d is not smaller than the dense phi of K = %d", top_m, model.K);
+  }
+  if (storage.compare("fused") == 0) {
+    if (!phi_codec.is_float()) throw std::invalid_argument("The fused storage keeps no phi to encode");
+    XPtr<PhiFused> retval(new PhiFused(model.item_size, model.K));
+    retval.attr("storage") = "fused";
+    return retval;
+  } else if (storage.compare("mmap") == 0) {
+    if (cached_file.compare("") == 0) throw std::invalid_argument("cached_file is required by the mmap storage");
+    XPtr<History> phistory(Rhistory);
+    XPtr<PhiList> retval(new PhiList(phistory->data, model.K, cached_file, phi_codec));
+    retval.attr("storage") = "mmap";
+    retval.attr("codec") = codec;
+    retval.attr("top_m") = top_m;
+    return retval;
+  } else if (storage.compare("") != 0 & storage.compare("memory") != 0 & storage.compare("disk") != 0) {
+    throw std::invalid_argument("Unknown storage type");
+  }
+  if (storage.compare("memory") == 0 | (storage.compare("") == 0 & cached_file.compare("") == 0)) {
     XPtr<History> phistory(Rhistory);
     History& history(*phistory);
-    XPtr<PhiList> retval(new PhiList(history.data.get_index(), history.data.get_index_size(), true));
+    XPtr<PhiList> retval(new PhiList(history.data, model.K, phi_codec));
     retval.attr("storage") = "memory";
+    retval.attr("codec") = codec;
+    retval.attr("top_m") = top_m;
     return retval;
   } else {
+    if (cached_file.compare("") == 0) throw std::invalid_argument("cached_file is required by the disk storage");
     XPtr< pPhiOnDiskVec > retval(new pPhiOnDiskVec());
 #pragma omp parallel
     {
@@ -27,104 +58,242 @@ SEXP init_phi(SEXP Rmodel, SEXP Rhistory, const std::string& cached_file = "", i
       size_t thread_id = omp_get_thread_num();
       std::string local_cached_file(cached_file);
       local_cached_file.append(std::to_string(thread_id));
-      retval->operator[](thread_id).reset(new PhiOnDisk(local_cached_file, cache_size));
+      retval->operator[](thread_id).reset(new PhiOnDisk(local_cached_file, model.K, cache_bytes, cache_buffers, phi_codec));
     }
     retval.attr("storage") = "disk";
+    retval.attr("codec") = codec;
+    retval.attr("top_m") = top_m;
     retval.attr("threads") = wrap<int>(retval->size());
     return retval;
   }
 }
 
-void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
-#ifdef NOISY_DEBUG
-  Rprintf("memory phi\n");
-#endif
-  Model *pmodel(as<Model*>(Rmodel));
-  Model& model(*pmodel);
-#ifdef NOISY_DEBUG
-  Rprintf("prior: (a1:%f a2:%f b2:%f c1:%f c2:%f d2:%f)\n", model.prior.a1, model.prior.a2, model.prior.b2,
-          model.prior.c1, model.prior.c2, model.prior.d2);
-#endif
-  XPtr<History> phistory(Rhistory);
-  History &history(*phistory);
-  if (model.user_size != history.user_size) throw std::invalid_argument("user_size is inconsistent");
-  XPtr<PhiList> pphi_list(Rphi);
-  PhiList& phi_list(*pphi_list);
-  if (phi_list.get_index_size() != model.user_size) throw std::invalid_argument("index_size of phi_list is inconsistent");
-  const int K(Param::K);
-  static std::vector<double> user_sum, item_sum;
-  user_sum.resize(K);
+// exp(E[log theta_{u,k}]) = exp(digamma(shp1[k])) / rte1[k]. It only depends on
+// the parameters of the row, so it is computed once per iteration instead of
+// once per nonzero. This is an orphaned work-sharing loop and it must be called
+// inside a parallel region.
+void update_exp_elog(const ParamBlock& block, DTYPE* cache) {
+  const int K(block.K);
+#pragma omp for
+  for(size_t i = 0;i < block.size;i++) {
+    ConstParamView param(block[i]);
+    DTYPE *target = cache + i * K;
+    for(int k = 0;k < K;k++) {
+      target[k] = exp(Rf_digamma(param.shp1[k])) / param.rte1[k];
+    }
+  }
+}
+
+ItemUpdate parse_item_update(const std::string& item_update) {
+  if (item_update.compare("atomic") == 0) return ITEM_UPDATE_ATOMIC;
+  if (item_update.compare("private") == 0) return ITEM_UPDATE_PRIVATE;
+  if (item_update.compare("gather") == 0) return ITEM_UPDATE_GATHER;
+  if (item_update.compare("tiled") == 0) return ITEM_UPDATE_TILED;
+  throw std::invalid_argument("Unknown item_update");
+}
+
+// The private mode keeps the `BWPMF_PRIVATE_BYTES / (K * sizeof(DTYPE))` items
+// with the largest degree in the private rows. The other modes never use them.
+std::shared_ptr<ItemAccumulator> init_item_accumulator(History& history, int K, ItemUpdate item_update) {
+  if (item_update != ITEM_UPDATE_PRIVATE) {
+    return std::shared_ptr<ItemAccumulator>(new ItemAccumulator(history.item_size, K, omp_get_max_threads()));
+  }
+  const size_t head_size = BWPMF_PRIVATE_BYTES / (K * sizeof(DTYPE));
+  return std::shared_ptr<ItemAccumulator>(new ItemAccumulator(history.get_item_index(), K, head_size, omp_get_max_threads()));
+}
+
+void TrainContext::prepare(const Model& model, History& _history, int _K, ItemUpdate _item_update) {
+  // see `TileScheduler::Segment`
+  if (_item_update == ITEM_UPDATE_TILED & model.user_size > UINT32_MAX) throw std::invalid_argument("The tiled item update supports fewer than 2^32 users");
+  user_sum.resize(_K);
   user_sum.shrink_to_fit();
-  item_sum.resize(K);
+  item_sum.resize(_K);
   item_sum.shrink_to_fit();
-#pragma omp parallel
+  user_exp_elog.resize(model.user_size * _K);
+  item_exp_elog.resize(model.item_size * _K);
+  if (history_generation != _history.generation) {
+    accumulator.reset();
+    scheduler.reset();
+    tiles.reset();
+  }
+  if (!accumulator || K != _K || item_update != _item_update || accumulator->get_threads() != omp_get_max_threads()) {
+    accumulator = init_item_accumulator(_history, _K, _item_update);
+  }
+  K = _K;
+  history_generation = _history.generation;
+  item_update = _item_update;
+}
+
+inline void log_message(Function* logger, const char* msg) {
+  if (logger != NULL) (*logger)(Rf_mkString(msg));
+}
+
+// The trainers below check their arguments in the constructor and `iterate`
+// runs one iteration. `iterate` is made of orphaned work-sharing loops and it
+// must be called by every thread of a parallel region, so several iterations
+// can run in one region, see `train`. The threads never call back into R 
+// there: the timing of the phases is pushed to the metrics if it is not NULL,
+// see `PhaseTimer`. `finish` is called after the parallel region.
+//
+// phi_{u,i,k} is proportional to exp(E[log theta_{u,k}] + E[log beta_{i,k}]), 
+// see `Kernel::phi`.
+
+template<int KS>
+class MemoryTrainer {
+  
+  Model& model;
+  
+  History& history;
+  
+  PhiList& phi_list;
+  
+  const int K;
+  
+  const PhiCodec& codec;
+  
+  const size_t row_bytes;
+  
+  TrainContext& context;
+  
+  ChunkScheduler& scheduler;
+  
+  TileScheduler& tiles;
+  
+  std::vector<double> &user_sum, &item_sum;
+  
+  AlignedArray<DTYPE> &user_exp_elog, &item_exp_elog;
+  
+  ItemUpdate item_update;
+  
+  const ItemIndex *item_index;
+  
+  std::shared_ptr<ItemAccumulator> accumulator;
+  
+public:
+  
+  MemoryTrainer(Model& _model, History& _history, PhiList& _phi_list, ItemUpdate _item_update)
+    : model(_model), history(_history), phi_list(_phi_list), K(Kernel<KS>::width(_model.K)),
+      codec(_phi_list.get_codec()), row_bytes(_phi_list.get_row_bytes()), context(get_train_context(_model)),
+      scheduler(context.scheduler), tiles(context.tiles), user_sum(context.user_sum), item_sum(context.item_sum), 
+      user_exp_elog(context.user_exp_elog), item_exp_elog(context.item_exp_elog),
+      item_update(_item_update), item_index(NULL), accumulator()
   {
+#ifdef NOISY_DEBUG
+    Rprintf("memory phi\n");
+    Rprintf("prior: (a1:%f a2:%f b2:%f c1:%f c2:%f d2:%f)\n", model.prior.a1, model.prior.a2, model.prior.b2,
+            model.prior.c1, model.prior.c2, model.prior.d2);
+#endif
+    if (model.user_size != history.user_size) throw std::invalid_argument("user_size is inconsistent");
+    if (phi_list.get_index_size() != model.user_size) throw std::invalid_argument("index_size of phi_list is inconsistent");
+    if (phi_list.get_K() != model.K) throw std::invalid_argument("K of phi_list is inconsistent");
+    context.prepare(model, history, K, item_update);
+    if (item_update == ITEM_UPDATE_GATHER) item_index = &history.get_item_index();
+    accumulator = context.accumulator;
+  }
+  
+  bool has_error() {
+    return false;
+  }
+  
+  void finish(Function* logger) { }
+  
+  void iterate(MetricsChannel* metrics) {
+    const int thread_id = omp_get_thread_num();
+    const size_t nnz = history.data.get_total_size();
+    PhaseTimer timer(metrics);
     std::vector<double> local_item_sum(K, 0.0), local_user_sum(K, 0.0);
-#pragma omp master
-    logger(Rf_mkString("Calculating phi..."));
+    // the decoded phi of the row
+    AlignedArray<DTYPE> buffer(K);
+#pragma omp single
+    {
+      scheduler.prepare(history.data, omp_get_num_threads());
+      if (item_update == ITEM_UPDATE_TILED) tiles.prepare(history.data, model.item_size, K * sizeof(DTYPE), omp_get_num_threads());
+    }
+    update_exp_elog(model.user_param, user_exp_elog.get());
+    update_exp_elog(model.item_param, item_exp_elog.get());
+    PosteriorMean *lagged = context.lagged_loss ? &context.mean : NULL;
+    if (lagged != NULL) lagged->update<KS>(model);
+    double loglik = 0.0;
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
-    for(size_t user = 0;user < history.user_size;user++) {
-      // Phi *pphi_start = phi_list(user), *pphi_end = phi_list(user + 1);
-      auto pphi_range = phi_list.range(user);
-      const ItemCount *item_count = history.data(user);
+    if (item_update == ITEM_UPDATE_TILED) {
+      // phi is written once per nonzero, so the strata need no barrier here
+      const ItemCount *data = history.data.get_data();
+      for(size_t stratum = 0;stratum < tiles.get_strata();stratum++) {
+        for(const auto& segment : tiles.get(thread_id, stratum)) {
+          const size_t user = tiles.user_begin(thread_id) + segment.user, offset = history.data.offset(user);
+          unsigned char *row = phi_list.get_data() + (offset + segment.begin) * row_bytes;
+          for(size_t j = offset + segment.begin;j < offset + segment.end;j++, row += row_bytes) {
+            DTYPE *phi = codec.target(row, buffer.get());
+            Kernel<KS>::phi(user_exp_elog.get() + user * K, item_exp_elog.get() + data[j].item * K, phi, K);
+            if (lagged != NULL) loglik += data[j].count * log(lagged->lambda<KS>(user, data[j].item));
+            codec.encode<KS>(phi, row, K);
+          }
+        }
+      }
+    } else {
+      scheduler.begin(thread_id);
+      for(size_t chunk_begin, chunk_end;scheduler.next(thread_id, chunk_begin, chunk_end);) {
+        for(size_t user = chunk_begin;user < chunk_end;user++) {
+          const auto range = history.data.range(user);
+          unsigned char *row = phi_list(user);
 #ifdef NOISY_DEBUG
-      if (history.data.size(user) != phi_list.size(user)) throw std::logic_error(
-        boost::str(boost::format("Inconsistent history size(%1%) and phi size(%2%)") % history.data.size(user) % phi_list.size(user))
-        );
+          if (history.data.size(user) != phi_list.size(user)) throw std::logic_error(
+            boost::str(boost::format("Inconsistent history size(%1%) and phi size(%2%)") % history.data.size(user) % phi_list.size(user))
+            );
 #endif
-      for(Phi *pphi = pphi_range.first; pphi != pphi_range.second;pphi++) {
-        size_t item = item_count->item;
+          for(const ItemCount *item_count = range.first; item_count != range.second;item_count++, row += row_bytes) {
+            size_t item = item_count->item;
+            DTYPE *phi = codec.target(row, buffer.get());
 #ifdef NOISY_DDEBUG
-        Rprintf("user: %zu item: %zu \n", user, item);
+            Rprintf("user: %zu item: %zu \n", user, item);
 #endif
-        Phi& phi(*pphi);
-        Param& user_param(model.user_param[user]), item_param(model.item_param[item]);
 #ifdef NOISY_DEBUG
-        if ((user == 0 | user == 1) & (pphi == pphi_range.first | pphi == pphi_range.first + 1)) {
-          Rprintf("user: %zu item: %zu \n", user, item);
-        }
+            ParamView user_param(model.user_param[user]), item_param(model.item_param[item]);
+            if ((user == 0 | user == 1) & (item_count == range.first | item_count == range.first + 1)) {
+              Rprintf("user: %zu item: %zu \n", user, item);
+            }
 #endif
-        for(int k = 0;k < K;k++) {
-          phi.data[k] = exp(Rf_digamma(user_param.shp1[k]) - log(user_param.rte1[k]) + Rf_digamma(item_param.shp1[k]) - log(item_param.rte1[k]));
-        }
+            Kernel<KS>::phi(user_exp_elog.get() + user * K, item_exp_elog.get() + item * K, phi, K);
+            if (lagged != NULL) loglik += item_count->count * log(lagged->lambda<KS>(user, item));
 #ifdef NOISY_DEBUG
-        if ((user == 0 | user == 1) & (pphi == pphi_range.first | pphi == pphi_range.first + 1)) {
-          for(int k = 0;k < K;k++) {
-            Rprintf("user_param.shp1[%d]: %f user_param.rte1[%d]: %f item_param.shp1[%d]: %f item_param.rte1[%d]: %f ",
-                  k, user_param.shp1[k], k, user_param.rte1[k], k, item_param.shp1[k], k, item_param.rte1[k]);
-            Rprintf("==> phi.data[%d]: %f\n", k, phi.data[k]);
-          }
-        }
+            if ((user == 0 | user == 1) & (item_count == range.first | item_count == range.first + 1)) {
+              for(int k = 0;k < K;k++) {
+                Rprintf("user_param.shp1[%d]: %f user_param.rte1[%d]: %f item_param.shp1[%d]: %f item_param.rte1[%d]: %f ",
+                      k, user_param.shp1[k], k, user_param.rte1[k], k, item_param.shp1[k], k, item_param.rte1[k]);
+                Rprintf("==> phi[%d]: %f\n", k, phi[k]);
+              }
+            }
 #endif
-        double denom = std::accumulate(phi.data, phi.data + K, 0.0);
-        std::transform(phi.data, phi.data + K, phi.data, [&denom](const double input) {
-          return input / denom;
-        });
 #ifdef NOISY_DEBUG
-        if ((user == 0 | user == 1) & (pphi == pphi_range.first | pphi == pphi_range.first + 1)) {
-          Rprintf("After reweighted, the sum of phi becomes: %f\n", std::accumulate(phi.data, phi.data + K, 0.0));
-          Rprintf("phi: ");
-          for(int k = 0;k < K;k++) {
-            Rprintf("phi.data[%d]: %f ", k, phi.data[k]);
+            if ((user == 0 | user == 1) & (item_count == range.first | item_count == range.first + 1)) {
+              Rprintf("After reweighted, the sum of phi becomes: %f\n", std::accumulate(phi, phi + K, 0.0));
+              Rprintf("phi: ");
+              for(int k = 0;k < K;k++) {
+                Rprintf("phi[%d]: %f ", k, phi[k]);
+              }
+              Rprintf("\n");
+            }
+#endif
+            codec.encode<KS>(phi, row, K);
           }
-          Rprintf("\n");
         }
-#endif
-        item_count++;
       }
     }
+    if (lagged != NULL) {
+#pragma omp atomic
+      lagged->loglik += loglik;
+    }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_PHI, nnz);
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
 
-#pragma omp master
-    logger(Rf_mkString("Updating user parameters..."));
-
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
@@ -142,10 +311,8 @@ void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
-      for(int k = 0;k < K;k++) {
-        local_item_sum[k] += item_param.shp1[k] / item_param.rte1[k];
-      }
+      ParamView item_param(model.item_param[item]);
+      Kernel<KS>::mean(item_param.shp1, item_param.rte1, &local_item_sum[0], K);
     }
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -160,45 +327,44 @@ void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
-    for(size_t user = 0;user < history.user_size;user++) {
-      Param& user_param(model.user_param[user]);
-      std::fill(user_param.shp1, user_param.shp1 + K, model.prior.a1);
-      std::transform(item_sum.begin(), item_sum.end(), user_param.rte1, [&user_param](const double input) {
-        return input + user_param.shp2 / user_param.rte2;
-      });
-      const auto range = history.data.range(user);
-      // const ItemCount *start = history.data(user), *end = history.data(user + 1);
-      const Phi* pphi = phi_list(user);
-      for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++) {
-        const size_t item = pitem_count->item;
-        const int y = pitem_count->count;
-        for(int k = 0;k < K;k++) {
-          user_param.shp1[k] += y * pphi->data[k];
+    scheduler.begin(thread_id);
+    for(size_t chunk_begin, chunk_end;scheduler.next(thread_id, chunk_begin, chunk_end);) {
+      for(size_t user = chunk_begin;user < chunk_end;user++) {
+        ParamView user_param(model.user_param[user]);
+        std::fill(user_param.shp1, user_param.shp1 + K, model.prior.a1);
+        std::transform(item_sum.begin(), item_sum.end(), user_param.rte1, [&user_param](const double input) {
+          return input + user_param.shp2 / user_param.rte2;
+        });
+        const auto range = history.data.range(user);
+        // const ItemCount *start = history.data(user), *end = history.data(user + 1);
+        const unsigned char* row = phi_list(user);
+        for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++, row += row_bytes) {
+          const size_t item = pitem_count->item;
+          const int y = pitem_count->count;
+          codec.axpy<KS>(y, row, buffer.get(), user_param.shp1, K);
         }
-        pphi++;
       }
     }
+#pragma omp barrier
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
+#pragma omp for nowait
     for(size_t user = 0;user < history.user_size;user++) {
-      Param& user_param(model.user_param[user]);
+      ParamView user_param(model.user_param[user]);
       user_param.rte2 = model.prior.a2 / model.prior.b2;
       for(int k = 0;k < K;k++) {
         user_param.rte2 += user_param.shp1[k] / user_param.rte1[k];
       }
     }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_USER, nnz);
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-
-    
-#pragma omp master
-    logger(Rf_mkString("Updating item parameters..."));
     
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -217,10 +383,8 @@ void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t user = 0;user < model.user_size;user++) {
-      Param& user_param(model.user_param[user]);
-      for(int k = 0;k < K;k++) {
-        local_user_sum[k] += user_param.shp1[k] / user_param.rte1[k];
-      }
+      ParamView user_param(model.user_param[user]);
+      Kernel<KS>::mean(user_param.shp1, user_param.rte1, &local_user_sum[0], K);
     }
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -237,7 +401,7 @@ void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
+      ParamView item_param(model.item_param[item]);
       std::fill(item_param.shp1, item_param.shp1 + K, model.prior.c1);
       std::transform(user_sum.begin(), user_sum.end(), item_param.rte1, [&item_param](const double input) {
         return input + item_param.shp2 / item_param.rte2;
@@ -247,84 +411,156 @@ void train_once_memory(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
-    for(size_t user = 0;user < history.user_size;user++) {
-      auto range = history.data.range(user);
-      // const ItemCount *start = history.data(user), *end = history.data(user + 1);
-      const Phi* pphi = phi_list(user);
-      for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++) {
-        const size_t item = pitem_count->item;
-        Param& item_param(model.item_param[item]);
-        const int y = pitem_count->count;
-        for(int k = 0;k < K;k++) {
-          double tmp = y * pphi->data[k];
-#pragma omp atomic
-          item_param.shp1[k] += tmp;
+    if (item_update == ITEM_UPDATE_GATHER) {
+      const ItemCount *data = history.data.get_data();
+#pragma omp for schedule(dynamic, 64)
+      for(size_t item = 0;item < model.item_size;item++) {
+        ParamView item_param(model.item_param[item]);
+        for(size_t j = item_index->index[item];j < item_index->index[item + 1];j++) {
+          const size_t position = item_index->position[j];
+          codec.axpy<KS>(data[position].count, phi_list.get_data() + position * row_bytes, buffer.get(), item_param.shp1, K);
+        }
+      }
+    } else if (item_update == ITEM_UPDATE_TILED) {
+      const ItemCount *data = history.data.get_data();
+      DTYPE *item_shp1 = model.item_param.shp1.get();
+      for(size_t stratum = 0;stratum < tiles.get_strata();stratum++) {
+        for(const auto& segment : tiles.get(thread_id, stratum)) {
+          const size_t offset = history.data.offset(tiles.user_begin(thread_id) + segment.user);
+          for(size_t j = offset + segment.begin;j < offset + segment.end;j++) {
+            codec.axpy<KS>(data[j].count, phi_list.get_data() + j * row_bytes, buffer.get(), item_shp1 + data[j].item * K, K);
+          }
+        }
+#pragma omp barrier
+      }
+    } else {
+      scheduler.begin(thread_id);
+      for(size_t chunk_begin, chunk_end;scheduler.next(thread_id, chunk_begin, chunk_end);) {
+        for(size_t user = chunk_begin;user < chunk_end;user++) {
+          auto range = history.data.range(user);
+          // const ItemCount *start = history.data(user), *end = history.data(user + 1);
+          const unsigned char* row = phi_list(user);
+          for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++, row += row_bytes) {
+            accumulator->add<KS>(thread_id, pitem_count->item, pitem_count->count, codec, row, buffer.get(), model.item_param.shp1.get());
+          }
         }
-        pphi++;
       }
+#pragma omp barrier
+      accumulator->merge(model.item_param.shp1.get());
     }
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
+#pragma omp for nowait
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
+      ParamView item_param(model.item_param[item]);
       item_param.rte2 = model.prior.c2 / model.prior.d2;
       for(int k = 0;k < K;k++) {
         item_param.rte2 += item_param.shp1[k] / item_param.rte1[k];
       }
     }
-    
-  } // #pragma omp parallel
-}
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_ITEM, nnz);
+  }
+  
+};
 
-void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
+template<int KS>
+class DiskTrainer {
+  
+  Model& model;
+  
+  History& history;
+  
+  pPhiOnDiskVec& phi_disk_vec;
+  
+  const int K;
+  
+  TrainContext& context;
+  
+  std::vector<double> &user_sum, &item_sum;
+  
+  AlignedArray<DTYPE> &user_exp_elog, &item_exp_elog;
+  
+  std::shared_ptr<ItemAccumulator> accumulator;
+  
+public:
+  
+  DiskTrainer(Model& _model, History& _history, pPhiOnDiskVec& _phi_disk_vec, ItemUpdate item_update)
+    : model(_model), history(_history), phi_disk_vec(_phi_disk_vec), K(Kernel<KS>::width(_model.K)),
+      context(get_train_context(_model)), user_sum(context.user_sum), item_sum(context.item_sum), 
+      user_exp_elog(context.user_exp_elog), item_exp_elog(context.item_exp_elog),
+      accumulator()
+  {
 #ifdef NOISY_DEBUG
-  Rprintf("disk phi\n");
+    Rprintf("disk phi\n");
+    Rprintf("prior: (a1:%f a2:%f b2:%f c1:%f c2:%f d2:%f)\n", 
+            model.prior.a1, model.prior.a2, model.prior.b2,
+            model.prior.c1, model.prior.c2, model.prior.d2);
 #endif
-  Model *pmodel(as<Model*>(Rmodel));
-  Model& model(*pmodel);
-#ifdef NOISY_DEBUG
-  Rprintf("prior: (a1:%f a2:%f b2:%f c1:%f c2:%f d2:%f)\n", 
-          model.prior.a1, model.prior.a2, model.prior.b2,
-          model.prior.c1, model.prior.c2, model.prior.d2);
-#endif
-  XPtr<History> phistory(Rhistory);
-  History &history(*phistory);
-  if (model.user_size != history.user_size) throw std::invalid_argument("user_size is inconsistent");
-  XPtr<pPhiOnDiskVec> pphi_disk_vec(Rphi);
-  // PhiOnDisk& phi_disk(*pphi_disk);
-  const int K(Param::K);
-  static std::vector<double> user_sum, item_sum;
-  user_sum.resize(K);
-  user_sum.shrink_to_fit();
-  item_sum.resize(K);
-  item_sum.shrink_to_fit();
-  bool is_valid = true;
+    if (model.user_size != history.user_size) throw std::invalid_argument("user_size is inconsistent");
+    for(auto& phi_disk : phi_disk_vec) {
+      if (phi_disk->get_K() != model.K) throw std::invalid_argument("K of phi is inconsistent");
+    }
+    if (item_update == ITEM_UPDATE_GATHER) throw std::invalid_argument("The gather item update requires the memory or mmap storage");
+    if (item_update == ITEM_UPDATE_TILED) throw std::invalid_argument("The tiled item update requires the memory, mmap or fused storage");
+    bool is_valid = true;
 #pragma omp parallel
-  {
-#pragma omp master 
     {
-      Rprintf("Checking threads...\n");
-      if (as<int>(pphi_disk_vec.attr("threads")) != omp_get_num_threads()) {
-        is_valid = false;
-      }
+#pragma omp master 
+      is_valid = phi_disk_vec.size() == omp_get_num_threads();
     }
+    if (!is_valid) throw std::runtime_error("The threads of phi and openmp are inconsistent!");
+    context.prepare(model, history, K, item_update);
+    accumulator = context.accumulator;
   }
-  if (!is_valid) throw std::runtime_error("The threads of phi and openmp are inconsistent!");
-#pragma omp parallel
-  {
+  
+  // an I/O error of any thread
+  bool has_error() {
+    for(auto& phi_disk : phi_disk_vec) {
+      if (phi_disk->has_error()) return true;
+    }
+    return false;
+  }
+  
+  // the bytes of phi transferred by the thread since `io_bytes`
+  static void record_io_bytes(PhaseTimer& timer, MetricPhase phase, PhiOnDisk& phi_disk, size_t& io_bytes) {
+    const size_t current = phi_disk.get_io_bytes();
+    timer.record(phase, METRIC_IO_BYTES, current - io_bytes);
+    io_bytes = current;
+  }
+  
+  void finish(Function* logger) {
+    double stall_seconds = 0.0;
+    for(auto& phi_disk : phi_disk_vec) {
+      phi_disk->check_error();
+      stall_seconds = std::max(stall_seconds, phi_disk->get_stall_seconds());
+    }
+    log_message(logger, boost::str(boost::format("The maximal I/O stall of the threads: %1% seconds") % stall_seconds).c_str());
+  }
+  
+  void iterate(MetricsChannel* metrics) {
     size_t thread_id = omp_get_thread_num();
-    PhiOnDisk& phi_disk(*pphi_disk_vec->operator[](thread_id).get());
+    PhiOnDisk& phi_disk(*phi_disk_vec[thread_id]);
+    const PhiCodec& codec(phi_disk.get_codec());
+    const size_t nnz = history.data.get_total_size();
+    PhaseTimer timer(metrics);
+    size_t io_bytes = phi_disk.get_io_bytes();
     std::vector<double> local_item_sum(K, 0.0), local_user_sum(K, 0.0);
-#pragma omp master
-    logger(Rf_mkString("Calculating phi..."));
-#pragma omp barrier
+    // the decoded phi of the row
+    AlignedArray<DTYPE> buffer(K);
+    update_exp_elog(model.user_param, user_exp_elog.get());
+    update_exp_elog(model.item_param, item_exp_elog.get());
+    PosteriorMean *lagged = context.lagged_loss ? &context.mean : NULL;
+    if (lagged != NULL) lagged->update<KS>(model);
+    double loglik = 0.0;
     {
       auto write_flag(phi_disk.get_write_flag());
-#pragma omp for
+      // the file of phi of a thread is read in the order written, so the users
+      // keep the static schedule instead of `ChunkScheduler`
+#pragma omp for nowait
       for(size_t user = 0;user < history.user_size;user++) {
         auto item_range = history.data.range(user);
         for(const ItemCount *pitem_count = item_range.first; pitem_count != item_range.second;pitem_count++) {
@@ -333,27 +569,28 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #pragma omp master
           Rprintf("user: %zu item: %zu \n", user, item);
 #endif
-          Phi& phi(phi_disk.get_write_target());
-          Param& user_param(model.user_param[user]), item_param(model.item_param[item]);
+          void *row = phi_disk.get_write_target();
+          DTYPE *phi = codec.target(row, buffer.get());
 #ifdef NOISY_DEBUG
           if ((user == 0 | user == 1) & (pitem_count == item_range.first | pitem_count == item_range.first + 1)) {
 #pragma omp master
             Rprintf("user: %zu item: %zu \n", user, item);
           }
 #endif
-          for(int k = 0;k < K;k++) {
-            phi.data[k] = exp(Rf_digamma(user_param.shp1[k]) - log(user_param.rte1[k]) + Rf_digamma(item_param.shp1[k]) - log(item_param.rte1[k]));
-          }
-          double denom = std::accumulate(phi.data, phi.data + K, 0.0);
-          std::transform(phi.data, phi.data + K, phi.data, [&denom](const double input) {
-            return input / denom;
-          });
+          Kernel<KS>::phi(user_exp_elog.get() + user * K, item_exp_elog.get() + item * K, phi, K);
+          if (lagged != NULL) loglik += pitem_count->count * log(lagged->lambda<KS>(user, item));
+          codec.encode<KS>(phi, row, K);
         }
       } // for
     }
-
-#pragma omp master
-    logger(Rf_mkString("Updating user parameters..."));
+    if (lagged != NULL) {
+#pragma omp atomic
+      lagged->loglik += loglik;
+    }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_PHI, nnz);
+    record_io_bytes(timer, METRIC_PHASE_PHI, phi_disk, io_bytes);
 
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -372,10 +609,8 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
-      for(int k = 0;k < K;k++) {
-        local_item_sum[k] += item_param.shp1[k] / item_param.rte1[k];
-      }
+      ParamView item_param(model.item_param[item]);
+      Kernel<KS>::mean(item_param.shp1, item_param.rte1, &local_item_sum[0], K);
     }
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -396,7 +631,7 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
       auto read_flag(phi_disk.get_read_flag());
 #pragma omp for
       for(size_t user = 0;user < history.user_size;user++) {
-        Param& user_param(model.user_param[user]);
+        ParamView user_param(model.user_param[user]);
         std::fill(user_param.shp1, user_param.shp1 + K, model.prior.a1);
         std::transform(item_sum.begin(), item_sum.end(), user_param.rte1, [&user_param](const double input) {
           return input + user_param.shp2 / user_param.rte2;
@@ -404,12 +639,8 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
         const auto range = history.data.range(user);
         // const ItemCount *start = history.data(user), *end = history.data(user + 1);
         for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++) {
-          const Phi& phi(phi_disk.get_read_target());
-          const size_t item = pitem_count->item;
           const int y = pitem_count->count;
-          for(int k = 0;k < K;k++) {
-            user_param.shp1[k] += y * phi.data[k];
-          }
+          codec.axpy<KS>(y, phi_disk.get_read_target(), buffer.get(), user_param.shp1, K);
         }
       } // for
     }
@@ -417,22 +648,22 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
+#pragma omp for nowait
     for(size_t user = 0;user < history.user_size;user++) {
-      Param& user_param(model.user_param[user]);
+      ParamView user_param(model.user_param[user]);
       user_param.rte2 = model.prior.a2 / model.prior.b2;
       for(int k = 0;k < K;k++) {
         user_param.rte2 += user_param.shp1[k] / user_param.rte1[k];
       }
     }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_USER, nnz);
+    record_io_bytes(timer, METRIC_PHASE_USER, phi_disk, io_bytes);
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-
-    
-#pragma omp master
-    logger(Rf_mkString("Updating item parameters..."));
     
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -451,10 +682,8 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t user = 0;user < model.user_size;user++) {
-      Param& user_param(model.user_param[user]);
-      for(int k = 0;k < K;k++) {
-        local_user_sum[k] += user_param.shp1[k] / user_param.rte1[k];
-      }
+      ParamView user_param(model.user_param[user]);
+      Kernel<KS>::mean(user_param.shp1, user_param.rte1, &local_user_sum[0], K);
     }
 #ifdef NOISY_DDEBUG
 #pragma omp master
@@ -473,7 +702,7 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
 #endif
 #pragma omp for
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
+      ParamView item_param(model.item_param[item]);
       std::fill(item_param.shp1, item_param.shp1 + K, model.prior.c1);
       std::transform(user_sum.begin(), user_sum.end(), item_param.rte1, [&item_param](const double input) {
         return input + item_param.shp2 / item_param.rte2;
@@ -491,114 +720,716 @@ void train_once_disk(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
         auto range = history.data.range(user);
         // const ItemCount *start = history.data(user), *end = history.data(user + 1);
         for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++) {
-          const Phi& phi(phi_disk.get_read_target());
-          const size_t item = pitem_count->item;
-          Param& item_param(model.item_param[item]);
-          const int y = pitem_count->count;
-          for(int k = 0;k < K;k++) {
-            double tmp = y * phi.data[k];
-#pragma omp atomic
-            item_param.shp1[k] += tmp;
-          }
+          accumulator->add<KS>(thread_id, pitem_count->item, pitem_count->count, codec, phi_disk.get_read_target(), buffer.get(), model.item_param.shp1.get());
         }
       } // for
     }
+    accumulator->merge(model.item_param.shp1.get());
 #pragma omp barrier
 #ifdef NOISY_DDEBUG
 #pragma omp master
       Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
 #endif
-#pragma omp for
+#pragma omp for nowait
     for(size_t item = 0;item < model.item_size;item++) {
-      Param& item_param(model.item_param[item]);
+      ParamView item_param(model.item_param[item]);
       item_param.rte2 = model.prior.c2 / model.prior.d2;
       for(int k = 0;k < K;k++) {
         item_param.rte2 += item_param.shp1[k] / item_param.rte1[k];
       }
     }
-    
-  } // #pragma omp parallel
-}
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_ITEM, nnz);
+    record_io_bytes(timer, METRIC_PHASE_ITEM, phi_disk, io_bytes);
+  }
+  
+};
 
+// The cumulative I/O statistics of each thread of the disk storage: the seconds
+// the thread waited for its I/O thread (`stall`), the seconds spent in 
+// pread/pwrite (`io`) and the bytes transferred.
 //[[Rcpp::export]]
-void train_once(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger) {
+DataFrame phi_disk_stats(SEXP Rphi, bool reset = false) {
+  RObject phi(Rphi);
+  if (as<std::string>(phi.attr("storage")).compare("disk") != 0) throw std::invalid_argument("phi is not stored on disk");
+  pPhiOnDiskVec& phi_disk_vec(*XPtr<pPhiOnDiskVec>(Rphi));
+  const size_t threads = phi_disk_vec.size();
+  IntegerVector thread(threads);
+  NumericVector stall(threads), io(threads), bytes(threads);
+  for(size_t i = 0;i < threads;i++) {
+    PhiOnDisk& phi_disk(*phi_disk_vec[i]);
+    thread[i] = i;
+    stall[i] = phi_disk.get_stall_seconds();
+    io[i] = phi_disk.get_io_seconds();
+    bytes[i] = phi_disk.get_io_bytes();
+    if (reset) phi_disk.reset_stats();
+  }
+  return DataFrame::create(Named("thread") = thread, Named("stall") = stall, Named("io") = io, Named("bytes") = bytes);
+}
+
+template<int KS>
+class FusedTrainer {
+  
+  Model& model;
+  
+  History& history;
+  
+  const int K;
+  
+  DTYPE *item_shp1;
+  
+  TrainContext& context;
+  
+  ChunkScheduler& scheduler;
+  
+  TileScheduler& tiles;
+  
+  std::vector<double> &user_sum, &item_sum;
+  
+  AlignedArray<DTYPE> &user_exp_elog, &item_exp_elog;
+  
+  ItemUpdate item_update;
+  
+  std::shared_ptr<ItemAccumulator> accumulator;
+  
+public:
+  
+  FusedTrainer(Model& _model, History& _history, PhiFused& phi_fused, ItemUpdate _item_update)
+    : model(_model), history(_history), K(Kernel<KS>::width(_model.K)), item_shp1(phi_fused.item_shp1.get()),
+      context(get_train_context(_model)), scheduler(context.scheduler), tiles(context.tiles), 
+      user_sum(context.user_sum), item_sum(context.item_sum), 
+      user_exp_elog(context.user_exp_elog), item_exp_elog(context.item_exp_elog),
+      item_update(_item_update), accumulator()
+  {
+#ifdef NOISY_DEBUG
+    Rprintf("fused phi\n");
+#endif
+    if (model.user_size != history.user_size) throw std::invalid_argument("user_size is inconsistent");
+    if (phi_fused.item_size != model.item_size) throw std::invalid_argument("item_size of phi is inconsistent");
+    if (phi_fused.K != model.K) throw std::invalid_argument("K of phi is inconsistent");
+    if (item_update == ITEM_UPDATE_GATHER) throw std::invalid_argument("The gather item update requires the memory or mmap storage");
+    context.prepare(model, history, K, item_update);
+    accumulator = context.accumulator;
+  }
+  
+  bool has_error() {
+    return false;
+  }
+  
+  void finish(Function* logger) { }
+  
+  void iterate(MetricsChannel* metrics) {
+    const int thread_id = omp_get_thread_num();
+    const size_t nnz = history.data.get_total_size();
+    PhaseTimer timer(metrics);
+    std::vector<double> local_item_sum(K, 0.0), local_user_sum(K, 0.0), user_shp1(K, 0.0);
+    std::vector<DTYPE> phi(K, 0.0);
+#pragma omp single
+    {
+      scheduler.prepare(history.data, omp_get_num_threads());
+      if (item_update == ITEM_UPDATE_TILED) tiles.prepare(history.data, model.item_size, 2 * K * sizeof(DTYPE), omp_get_num_threads());
+    }
+    update_exp_elog(model.user_param, user_exp_elog.get());
+    update_exp_elog(model.item_param, item_exp_elog.get());
+    PosteriorMean *lagged = context.lagged_loss ? &context.mean : NULL;
+    if (lagged != NULL) lagged->update<KS>(model);
+    double loglik = 0.0;
+#pragma omp single
+    std::fill(item_sum.begin(), item_sum.end(), 0.0);
+#pragma omp for
+    for(size_t item = 0;item < model.item_size;item++) {
+      ParamView item_param(model.item_param[item]);
+      Kernel<KS>::mean(item_param.shp1, item_param.rte1, &local_item_sum[0], K);
+    }
+#pragma omp critical
+    for(int k = 0;k < K;k++) {
+      item_sum[k] += local_item_sum[k];
+    }
+#pragma omp barrier
+    // The phi of the user only depends on the parameters of the user and the 
+    // items, and the items are left untouched in this pass. Therefore the 
+    // whole update of the user is done right after its phi.
+#pragma omp single
+    std::fill(user_sum.begin(), user_sum.end(), 0.0);
+    if (item_update == ITEM_UPDATE_TILED) {
+      // The thread owns the users of its block in every stratum, so their shp1 
+      // is accumulated in place across the strata.
+      const ItemCount *data = history.data.get_data();
+      for(size_t user = tiles.user_begin(thread_id);user < tiles.user_end(thread_id);user++) {
+        ParamView user_param(model.user_param[user]);
+        std::fill(user_param.shp1, user_param.shp1 + K, model.prior.a1);
+      }
+      for(size_t stratum = 0;stratum < tiles.get_strata();stratum++) {
+        for(const auto& segment : tiles.get(thread_id, stratum)) {
+          const size_t user = tiles.user_begin(thread_id) + segment.user, offset = history.data.offset(user);
+          DTYPE *user_shp1 = model.user_param.shp1.get() + user * K;
+          for(size_t j = offset + segment.begin;j < offset + segment.end;j++) {
+            const size_t item = data[j].item;
+            const int y = data[j].count;
+            Kernel<KS>::phi(user_exp_elog.get() + user * K, item_exp_elog.get() + item * K, &phi[0], K);
+            if (lagged != NULL) loglik += y * log(lagged->lambda<KS>(user, item));
+            Kernel<KS>::axpy(y, &phi[0], user_shp1, K);
+            Kernel<KS>::axpy(y, &phi[0], item_shp1 + item * K, K);
+          }
+        }
+#pragma omp barrier
+      }
+      for(size_t user = tiles.user_begin(thread_id);user < tiles.user_end(thread_id);user++) {
+        ParamView user_param(model.user_param[user]);
+        std::transform(item_sum.begin(), item_sum.end(), user_param.rte1, [&user_param](const double input) {
+          return input + user_param.shp2 / user_param.rte2;
+        });
+        user_param.rte2 = model.prior.a2 / model.prior.b2;
+        for(int k = 0;k < K;k++) {
+          double score = user_param.shp1[k] / user_param.rte1[k];
+          user_param.rte2 += score;
+          local_user_sum[k] += score;
+        }
+      }
+    } else {
+      scheduler.begin(thread_id);
+      for(size_t chunk_begin, chunk_end;scheduler.next(thread_id, chunk_begin, chunk_end);) {
+        for(size_t user = chunk_begin;user < chunk_end;user++) {
+          ParamView user_param(model.user_param[user]);
+          std::fill(user_shp1.begin(), user_shp1.end(), model.prior.a1);
+          const auto range = history.data.range(user);
+          for(const ItemCount *pitem_count = range.first; pitem_count != range.second;pitem_count++) {
+            const size_t item = pitem_count->item;
+            const int y = pitem_count->count;
+            Kernel<KS>::phi(user_exp_elog.get() + user * K, item_exp_elog.get() + item * K, &phi[0], K);
+            if (lagged != NULL) loglik += y * log(lagged->lambda<KS>(user, item));
+            Kernel<KS>::axpy(y, &phi[0], &user_shp1[0], K);
+            accumulator->add<KS>(thread_id, item, y, &phi[0], item_shp1);
+          }
+          std::copy(user_shp1.begin(), user_shp1.end(), user_param.shp1);
+          std::transform(item_sum.begin(), item_sum.end(), user_param.rte1, [&user_param](const double input) {
+            return input + user_param.shp2 / user_param.rte2;
+          });
+          user_param.rte2 = model.prior.a2 / model.prior.b2;
+          for(int k = 0;k < K;k++) {
+            double score = user_param.shp1[k] / user_param.rte1[k];
+            user_param.rte2 += score;
+            local_user_sum[k] += score;
+          }
+        }
+      }
+    }
+#pragma omp critical
+    for(int k = 0;k < K;k++) {
+      user_sum[k] += local_user_sum[k];
+    }
+    if (lagged != NULL) {
+#pragma omp atomic
+      lagged->loglik += loglik;
+    }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_PHI, nnz);
+    accumulator->merge(item_shp1);
+#pragma omp for nowait
+    for(size_t item = 0;item < model.item_size;item++) {
+      ParamView item_param(model.item_param[item]);
+      DTYPE *source = item_shp1 + item * K;
+      std::transform(source, source + K, item_param.shp1, [this](const double input) {
+        return input + model.prior.c1;
+      });
+      std::fill(source, source + K, 0.0);
+      std::transform(user_sum.begin(), user_sum.end(), item_param.rte1, [&item_param](const double input) {
+        return input + item_param.shp2 / item_param.rte2;
+      });
+      item_param.rte2 = model.prior.c2 / model.prior.d2;
+      for(int k = 0;k < K;k++) {
+        item_param.rte2 += item_param.shp1[k] / item_param.rte1[k];
+      }
+    }
+    timer.work_done();
+#pragma omp barrier
+    timer.end(METRIC_PHASE_ITEM, 0);
+  }
+  
+};
+
+// The trainer of the storage of phi, see `init_phi`.
+template<int KS, typename Fun>
+typename Fun::result_type with_trainer(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, ItemUpdate item_update, Fun fun) {
   RObject phi(Rphi);
   const std::string storage(as<std::string>(phi.attr("storage")));
-  if (storage.compare("memory") == 0) {
-    return train_once_memory(Rmodel, Rhistory, Rphi, logger);
+  Model& model(*as<Model*>(Rmodel));
+  History& history(*XPtr<History>(Rhistory));
+  if (storage.compare("memory") == 0 | storage.compare("mmap") == 0) {
+    MemoryTrainer<KS> trainer(model, history, *XPtr<PhiList>(Rphi), item_update);
+    return fun(trainer);
   } else if (storage.compare("disk") == 0) {
-    return train_once_disk(Rmodel, Rhistory, Rphi, logger);
+    DiskTrainer<KS> trainer(model, history, *XPtr<pPhiOnDiskVec>(Rphi), item_update);
+    return fun(trainer);
+  } else if (storage.compare("fused") == 0) {
+    FusedTrainer<KS> trainer(model, history, *XPtr<PhiFused>(Rphi), item_update);
+    return fun(trainer);
   } else {
     throw std::invalid_argument("Cannot specify the storage mode of Rphi");
   }
 }
+
+// The logger is called after the parallel region with the seconds of each 
+// phase.
+struct TrainOnce {
+  
+  typedef void result_type;
+  
+  Function& logger;
+  
+  MetricsChannel& metrics;
+  
+  template<typename Trainer>
+  void operator()(Trainer& trainer) {
+    const uint64_t start = metrics.position();
+#pragma omp parallel
+    trainer.iterate(&metrics);
+    metrics.flush();
+    metrics.iteration++;
+    for(uint64_t i = start;i < metrics.position();i++) {
+      const MetricRecord& record(metrics[i]);
+      if (record.thread != -1 | record.type != METRIC_WALL) continue;
+      log_message(&logger, boost::str(boost::format("The phase %1% took %2% seconds") % metric_phase_name(record.phase) % record.value).c_str());
+    }
+    trainer.finish(&logger);
+    metrics.check_error();
+  }
   
+};
 
+template<int KS>
+void train_once(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function& logger, ItemUpdate item_update, MetricsChannel& metrics) {
+  TrainOnce fun = { logger, metrics };
+  with_trainer<KS>(Rmodel, Rhistory, Rphi, item_update, fun);
+}
+
+// The metrics of the iteration are pushed to `Rmetrics` if it is not NULL, 
+// see `init_metrics`.
 //[[Rcpp::export]]
-double pmf_logloss(SEXP Rmodel, SEXP Rhistory) {
-  Model* pmodel(as<Model*>(Rmodel));
-  Model& model(*pmodel);
-  XPtr<History> phistory(Rhistory);
-  History& history(*phistory);
-  static std::vector<double> user_sum, item_sum;
-  user_sum.resize(model.K, 0.0);
-  std::fill(user_sum.begin(), user_sum.end(), 0.0);
-  item_sum.resize(model.K, 0.0);
-  std::fill(item_sum.begin(), item_sum.end(), 0.0);
-  double retval = 0.0;
-#pragma omp parallel
+void train_once(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, Function logger, const std::string& item_update = "atomic", SEXP Rmetrics = R_NilValue) {
+  const ItemUpdate mode(parse_item_update(item_update));
+  const int K(as<Model*>(Rmodel)->K);
+  // enough for the records of one iteration
+  MetricsChannel local(16 * (omp_get_max_threads() + 1));
+  MetricsChannel& metrics(Rmetrics == R_NilValue ? local : *XPtr<MetricsChannel>(Rmetrics));
+  BWPMF_DISPATCH_K(K, train_once, Rmodel, Rhistory, Rphi, logger, mode, metrics)
+}
+
+// A channel of the metrics of the training, see `MetricsChannel`. The records
+// beyond `capacity` are dropped until they are drained. If `sink` is not 
+// empty, the records are appended to the file `sink` after every iteration of
+// `train_once` or `train` instead, so the capacity only has to hold one 
+// iteration.
+//[[Rcpp::export]]
+SEXP init_metrics(double capacity = 65536, const std::string& sink = "") {
+  if (capacity < 1) throw std::invalid_argument("capacity should be positive");
+  XPtr<MetricsChannel> retval(new MetricsChannel(capacity, sink));
+  return retval;
+}
+
+// Returns and discards the records of the metrics. The attribute "dropped" is
+// the number of the records dropped since the last call.
+//[[Rcpp::export]]
+DataFrame drain_metrics(SEXP Rmetrics) {
+  MetricsChannel& metrics(*XPtr<MetricsChannel>(Rmetrics));
+  std::vector<int> iteration, thread;
+  std::vector<std::string> phase, metric;
+  std::vector<double> value;
+  const uint64_t dropped = metrics.drain([&](const MetricRecord& record) {
+    iteration.push_back(record.iteration);
+    phase.push_back(metric_phase_name(record.phase));
+    thread.push_back(record.thread);
+    metric.push_back(metric_type_name(record.type));
+    value.push_back(record.value);
+  });
+  DataFrame retval(DataFrame::create(Named("iteration") = wrap(iteration), Named("phase") = wrap(phase), 
+    Named("thread") = wrap(thread), Named("metric") = wrap(metric), Named("value") = wrap(value), 
+    Named("stringsAsFactors") = false));
+  retval.attr("dropped") = static_cast<double>(dropped);
+  return retval;
+}
+
+// The load of each thread in the scheduled loops of the users since the last
+// reset: the chunks claimed, the chunks stolen from the others and the nonzeros
+// of the claimed chunks. Only the memory and fused storage are scheduled by 
+// chunks, see `ChunkScheduler`.
+//[[Rcpp::export]]
+DataFrame train_load_stats(SEXP Rmodel, bool reset = false) {
+  Model& model(*as<Model*>(Rmodel));
+  if (!model.context) throw std::logic_error("The model is not trained yet");
+  ChunkScheduler& scheduler(model.context->scheduler);
+  const int threads = scheduler.get_threads();
+  IntegerVector thread(threads);
+  NumericVector chunks(threads), stolen(threads), nnz(threads);
+  for(int i = 0;i < threads;i++) {
+    thread[i] = i;
+    chunks[i] = scheduler.get_chunks(i);
+    stolen[i] = scheduler.get_stolen(i);
+    nnz[i] = scheduler.get_nnz(i);
+  }
+  if (reset) scheduler.reset_load();
+  return DataFrame::create(Named("thread") = thread, Named("chunks") = chunks, Named("stolen") = stolen, Named("nnz") = nnz);
+}
+  
+
+// The logloss summed by the threads.
+struct LogLossSum {
+  
+  double value;
+  
+  ChunkScheduler scheduler;
+  
+};
+
+// Sets `sum.value` to the logloss of the history with the posterior means of
+// the model, see `PosteriorMean`. The means can be shared by the histories of
+// the same model, e.g. the training and the testing one. This is made of 
+// orphaned work-sharing loops and it must be called inside a parallel region.
+template<int KS>
+void pmf_logloss_sum(const PosteriorMean& mean, const History& history, LogLossSum& sum) {
+  const int K(mean.K), thread_id(omp_get_thread_num());
+#pragma omp single
   {
-  std::vector<double> local_user_sum(model.K, 0.0), local_item_sum(model.K, 0.0);
+    sum.value = 0.0;
+    sum.scheduler.prepare(history.data, omp_get_num_threads());
+  }
   double local_retval = 0.0;
-    // y log(lambda)
-#pragma omp for
-    for(size_t user = 0;user < history.user_size;user++) {
-      const Param& user_param(model.user_param[user]);
+  // y log(lambda)
+  sum.scheduler.begin(thread_id);
+  for(size_t chunk_begin, chunk_end;sum.scheduler.next(thread_id, chunk_begin, chunk_end);) {
+    for(size_t user = chunk_begin;user < chunk_end;user++) {
+      const DTYPE *user_mean = mean.user.get() + user * K;
       auto range = history.data.range(user);
-      // const ItemCount *start = history.data(user), *end = history.data(user + 1);
       for(const ItemCount *item_count = range.first; item_count != range.second;item_count++) {
-        const size_t item = item_count->item;
-        const int y = item_count->count;
-        const Param& item_param(model.item_param[item]);
-        double lambda = 0.0;
-        for(int k = 0;k < model.K;k++) {
-          double user_score = user_param.shp1[k] / user_param.rte1[k];
-          double item_score = item_param.shp1[k] / item_param.rte1[k];
-          lambda += user_score * item_score;
-        }
-        local_retval += y * log(lambda);
+        local_retval += item_count->count * log(Kernel<KS>::dot(user_mean, mean.item.get() + item_count->item * K, K));
       }
     }
-    // sum(theat_{u,k})
-#pragma omp for
-    for(size_t user = 0;user < model.user_size;user++) {
-      const auto& param(model.user_param[user]);
-      for(int k = 0;k < model.K;k++) {
-        local_user_sum[k] += param.shp1[k] / param.rte1[k];
+  }
+#pragma omp atomic
+  sum.value += local_retval;
+#pragma omp barrier
+#pragma omp single
+  sum.value = mean.logloss(sum.value);
+}
+
+template<int KS>
+double pmf_logloss(const Model& model, const History& history) {
+  PosteriorMean mean;
+  LogLossSum sum;
+#pragma omp parallel
+  {
+    mean.update<KS>(model);
+    pmf_logloss_sum<KS>(mean, history, sum);
+  }
+  return sum.value;
+}
+
+//[[Rcpp::export]]
+double pmf_logloss(SEXP Rmodel, SEXP Rhistory) {
+  Model* pmodel(as<Model*>(Rmodel));
+  Model& model(*pmodel);
+  const History& history(*XPtr<History>(Rhistory));
+  BWPMF_DISPATCH_K(model.K, pmf_logloss, model, history)
+}
+
+// The seconds of the update and the logloss of each iteration, and the reason
+// to stop.
+struct TrainTrace {
+  
+  std::vector<double> seconds, loss, testing_loss;
+  
+  std::string status;
+  
+};
+
+// The iterations of `train` in one parallel region. The master thread records
+// the trace and decides to stop between the iterations. It never calls into R,
+// so it also runs in the threads of `sweep`.
+//
+// If `lagged_loss`, the training logloss of an iteration is accumulated by the
+// pass of phi of the next one, see `TrainContext::lagged_loss`, and only the 
+// last iteration is evaluated by another pass. So the convergence is noticed
+// one iteration later.
+template<int KS>
+struct TrainLoop {
+  
+  typedef TrainTrace result_type;
+  
+  const Model& model;
+  
+  const History& history;
+  
+  const History* testing;
+  
+  int iterations, eval_every, patience;
+  
+  double tol;
+  
+  MetricsChannel* metrics;
+  
+  bool lagged_loss;
+  
+  template<typename Trainer>
+  TrainTrace operator()(Trainer& trainer) {
+    typedef std::chrono::steady_clock Clock;
+    TrainTrace trace;
+    std::vector<double> &seconds(trace.seconds), &loss(trace.loss), &testing_loss(trace.testing_loss);
+    // the means after the iteration, and before the iteration in `context`
+    PosteriorMean mean;
+    const PosteriorMean& lagged_mean(model.context->mean);
+    model.context->lagged_loss = lagged_loss;
+    LogLossSum training_sum, testing_sum;
+    std::string& status(trace.status);
+    status = "max_iterations";
+    bool stop = false;
+    double best = std::numeric_limits<double>::infinity();
+    int no_improvement = 0;
+    Clock::time_point start;
+#pragma omp parallel
+    {
+      for(int i = 0;i < iterations;i++) {
+#pragma omp master
+        start = Clock::now();
+        trainer.iterate(metrics);
+#pragma omp master
+        seconds.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+        const bool evaluated = testing != NULL && (i + 1) % eval_every == 0;
+        if (!lagged_loss | evaluated) mean.update<KS>(model);
+        if (!lagged_loss) pmf_logloss_sum<KS>(mean, history, training_sum);
+        if (evaluated) pmf_logloss_sum<KS>(mean, *testing, testing_sum);
+#pragma omp master
+        {
+          if (metrics != NULL) {
+            metrics->iteration++;
+            metrics->flush();
+          }
+          if (!lagged_loss) loss.push_back(training_sum.value);
+          else if (i > 0) loss.push_back(lagged_mean.logloss(lagged_mean.loglik));
+          testing_loss.push_back(evaluated ? testing_sum.value : NA_REAL);
+          const size_t n = loss.size();
+          if (trainer.has_error()) {
+            status = "error";
+            stop = true;
+          } else if (n > 1 && std::abs(loss[n - 1] - loss[n - 2]) < tol * std::abs(loss[n - 2])) {
+            status = "converged";
+            stop = true;
+          } else if (evaluated & patience > 0) {
+            if (testing_sum.value < best) {
+              best = testing_sum.value;
+              no_improvement = 0;
+            } else if (++no_improvement >= patience) {
+              status = "early_stopped";
+              stop = true;
+            }
+          }
+        }
+#pragma omp barrier
+        if (stop) break;
       }
-    }
-    // sum(beta_{i,k})
-#pragma omp for
-    for(size_t item = 0;item < model.item_size;item++) {
-      const auto& param(model.item_param[item]);
-      for(int k = 0;k < model.K;k++) {
-        local_item_sum[k] += param.shp1[k] / param.rte1[k];
+      if (lagged_loss & !seconds.empty()) {
+        mean.update<KS>(model);
+        pmf_logloss_sum<KS>(mean, history, training_sum);
+#pragma omp master
+        loss.push_back(training_sum.value);
       }
-    }
-    
-#pragma omp critical
-    {
-      for(int k = 0;k < model.K;k++) {
-        user_sum[k] += local_user_sum[k];
-        item_sum[k] += local_item_sum[k];
+    } // #pragma omp parallel
+    model.context->lagged_loss = false;
+    if (metrics != NULL) metrics->flush();
+    trainer.finish(NULL);
+    if (metrics != NULL) metrics->check_error();
+    return trace;
+  }
+  
+};
+
+template<int KS>
+DataFrame train(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, int iterations, double tol, const History* testing, int eval_every, int patience, 
+                ItemUpdate item_update, MetricsChannel* metrics, bool lagged_loss) {
+  TrainLoop<KS> fun = { *as<Model*>(Rmodel), *XPtr<History>(Rhistory), testing, iterations, eval_every, patience, tol, metrics, lagged_loss };
+  const TrainTrace trace(with_trainer<KS>(Rmodel, Rhistory, Rphi, item_update, fun));
+  IntegerVector iteration(trace.loss.size());
+  for(size_t i = 0;i < trace.loss.size();i++) iteration[i] = i + 1;
+  DataFrame retval(DataFrame::create(Named("iteration") = iteration, Named("seconds") = wrap(trace.seconds), 
+    Named("loss") = wrap(trace.loss), Named("testing_loss") = wrap(trace.testing_loss)));
+  retval.attr("status") = trace.status;
+  return retval;
+}
+
+// Runs at most `iterations` iterations of `train_once` in one parallel region
+// without calling back into R. It stops once the relative change of the 
+// logloss of `Rhistory` is less than `tol`, or once the logloss of `Rtesting`,
+// evaluated every `eval_every` iterations, has not improved for `patience` 
+// evaluations. The model is the one of the last iteration. It returns the 
+// seconds of the update and the logloss of each iteration, and the reason to 
+// stop in the attribute "status". The metrics of the iterations are pushed to 
+// `Rmetrics` if it is not NULL. If `lagged_loss`, the training logloss is 
+// accumulated by the next iteration instead of another pass over `Rhistory`, 
+// see `TrainLoop`.
+//[[Rcpp::export]]
+DataFrame train(SEXP Rmodel, SEXP Rhistory, SEXP Rphi, int iterations, double tol = 0, SEXP Rtesting = R_NilValue, 
+                int eval_every = 1, int patience = 0, const std::string& item_update = "atomic", SEXP Rmetrics = R_NilValue,
+                bool lagged_loss = false) {
+  const ItemUpdate mode(parse_item_update(item_update));
+  if (iterations < 0) throw std::invalid_argument("iterations should be non-negative");
+  if (eval_every < 1) throw std::invalid_argument("eval_every should be positive");
+  const History* testing = Rtesting == R_NilValue ? NULL : XPtr<History>(Rtesting).get();
+  MetricsChannel* metrics = Rmetrics == R_NilValue ? NULL : XPtr<MetricsChannel>(Rmetrics).get();
+  const int K(as<Model*>(Rmodel)->K);
+  BWPMF_DISPATCH_K(K, train, Rmodel, Rhistory, Rphi, iterations, tol, testing, eval_every, patience, mode, metrics, lagged_loss)
+}
+
+// A configuration of `sweep` and its result.
+struct SweepTask {
+  
+  Prior prior;
+  
+  int K;
+  
+  TrainTrace trace;
+  
+  // the logloss of the testing history after the training
+  double testing_loss;
+  
+  std::string error;
+  
+};
+
+// Trains a new model of the task with the threads of the caller. 
+template<int KS>
+Model* sweep_train(SweepTask& task, History& history, const History& testing, bool fused, int iterations, double tol, 
+                   int eval_every, int patience, ItemUpdate item_update) {
+  std::unique_ptr<Model> model(new Model(task.prior, task.K, history.user_size, history.item_size));
+  TrainLoop<KS> loop = { *model, history, &testing, iterations, eval_every, patience, tol, NULL, false };
+  if (fused) {
+    PhiFused phi(model->item_size, model->K);
+    FusedTrainer<KS> trainer(*model, history, phi, item_update);
+    task.trace = loop(trainer);
+  } else {
+    PhiList phi(history.data, model->K);
+    MemoryTrainer<KS> trainer(*model, history, phi, item_update);
+    task.trace = loop(trainer);
+  }
+  task.testing_loss = pmf_logloss<KS>(*model, testing);
+  return model.release();
+}
+
+Model* sweep_train(SweepTask& task, History& history, const History& testing, bool fused, int iterations, double tol, 
+                   int eval_every, int patience, ItemUpdate item_update) {
+  BWPMF_DISPATCH_K(task.K, sweep_train, task, history, testing, fused, iterations, tol, eval_every, patience, item_update)
+}
+
+// Trains the tasks with `threads` threads in total and returns the model of
+// the smallest testing logloss, whose index is `best_id`. The error of a task
+// is kept in `SweepTask::error`.
+Model* sweep_tasks(std::vector<SweepTask>& tasks, History& history, const History& testing, int threads, bool fused, 
+                   int iterations, double tol, int eval_every, int patience, ItemUpdate item_update, size_t& best_id) {
+  const int workers = std::min<size_t>(threads, tasks.size());
+  std::atomic<size_t> next(0);
+  std::mutex mutex;
+  std::unique_ptr<Model> best;
+  std::vector<std::thread> pool;
+  for(int worker = 0;worker < workers;worker++) {
+    const int team = threads / workers + (worker < threads % workers);
+    pool.push_back(std::thread([&, team]() {
+      omp_set_num_threads(team);
+      for(size_t i = next++;i < tasks.size();i = next++) {
+        SweepTask& task(tasks[i]);
+        try {
+          std::unique_ptr<Model> model(sweep_train(task, history, testing, fused, iterations, tol, eval_every, patience, item_update));
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!best || task.testing_loss < tasks[best_id].testing_loss) {
+            best.swap(model);
+            best_id = i;
+          }
+        } catch (std::exception& e) {
+          task.error = e.what();
+        }
       }
-      retval += local_retval;
+    }));
+  }
+  for(auto& worker : pool) worker.join();
+  return best.release();
+}
+
+// Trains a model for every pair of `priors` and `K` with `train` and keeps the
+// one with the smallest logloss of `Rtesting`. The models share `Rhistory` and
+// run concurrently: the `threads` (all of OpenMP if 0) are split between 
+// `min(threads, configurations)` workers, each with its own OpenMP team, and 
+// each worker trains the next configuration once it is done with one. Only 
+// the best model and the models in training are kept in memory.
+//
+// `priors` is a list of named numeric vectors of a1, a2, b2, c1, c2 and d2. The
+// phi is kept in memory or fused, see `init_phi`. It returns the summary of 
+// each configuration, the trace of all of them, the index of the best one and
+// the best model.
+//[[Rcpp::export]]
+List sweep(SEXP Rhistory, List priors, IntegerVector K, SEXP Rtesting, int iterations, int threads = 0, double tol = 0,
+           int eval_every = 1, int patience = 0, const std::string& storage = "memory", const std::string& item_update = "atomic") {
+  History& history(*XPtr<History>(Rhistory));
+  const History& testing(*XPtr<History>(Rtesting));
+  const ItemUpdate mode(parse_item_update(item_update));
+  if (storage.compare("memory") != 0 & storage.compare("fused") != 0) throw std::invalid_argument("sweep keeps phi in memory or fused");
+  if (iterations < 0) throw std::invalid_argument("iterations should be non-negative");
+  if (eval_every < 1) throw std::invalid_argument("eval_every should be positive");
+  if (threads < 0) throw std::invalid_argument("threads should be non-negative");
+  if (testing.user_size != history.user_size | testing.item_size != history.item_size) throw std::invalid_argument("The testing history is inconsistent");
+  std::vector<SweepTask> tasks;
+  for(int i = 0;i < priors.size();i++) {
+    NumericVector prior(priors[i]);
+    for(int j = 0;j < K.size();j++) {
+      if (K[j] <= 0) throw std::invalid_argument("K should be positive");
+      SweepTask task;
+      task.prior = Prior(prior["a1"], prior["a2"], prior["b2"], prior["c1"], prior["c2"], prior["d2"]);
+      task.K = K[j];
+      task.testing_loss = NA_REAL;
+      tasks.push_back(task);
+    }
+  }
+  if (tasks.empty()) throw std::invalid_argument("No configuration to sweep");
+  size_t best_id = 0;
+  std::unique_ptr<Model> best(sweep_tasks(tasks, history, testing, threads > 0 ? threads : omp_get_max_threads(), 
+    storage.compare("fused") == 0, iterations, tol, eval_every, patience, mode, best_id));
+  for(size_t i = 0;i < tasks.size();i++) {
+    if (!tasks[i].error.empty()) throw std::runtime_error(boost::str(boost::format("The configuration %1% failed: %2%") % (i + 1) % tasks[i].error));
+  }
+  const size_t size = tasks.size();
+  IntegerVector config(size), k(size), trained(size);
+  NumericVector a1(size), a2(size), b2(size), c1(size), c2(size), d2(size), seconds(size), testing_loss(size);
+  CharacterVector status(size);
+  std::vector<int> trace_config, trace_iteration;
+  std::vector<double> trace_seconds, trace_loss, trace_testing_loss;
+  for(size_t i = 0;i < size;i++) {
+    const SweepTask& task(tasks[i]);
+    config[i] = i + 1;
+    k[i] = task.K;
+    a1[i] = task.prior.a1;
+    a2[i] = task.prior.a2;
+    b2[i] = task.prior.b2;
+    c1[i] = task.prior.c1;
+    c2[i] = task.prior.c2;
+    d2[i] = task.prior.d2;
+    trained[i] = task.trace.loss.size();
+    seconds[i] = std::accumulate(task.trace.seconds.begin(), task.trace.seconds.end(), 0.0);
+    status[i] = task.trace.status;
+    testing_loss[i] = task.testing_loss;
+    for(size_t j = 0;j < task.trace.loss.size();j++) {
+      trace_config.push_back(i + 1);
+      trace_iteration.push_back(j + 1);
+      trace_seconds.push_back(task.trace.seconds[j]);
+      trace_loss.push_back(task.trace.loss[j]);
+      trace_testing_loss.push_back(task.trace.testing_loss[j]);
     }
-  } // #pragma omp parallel
-  for(int k = 0;k < model.K;k++) {
-    retval -= user_sum[k] * item_sum[k];
   }
-  return -retval;
+  DataFrame summary(DataFrame::create(Named("config") = config, Named("K") = k, Named("a1") = a1, Named("a2") = a2, 
+    Named("b2") = b2, Named("c1") = c1, Named("c2") = c2, Named("d2") = d2, Named("iterations") = trained, 
+    Named("seconds") = seconds, Named("status") = status, Named("testing_loss") = testing_loss, 
+    Named("stringsAsFactors") = false));
+  DataFrame trace(DataFrame::create(Named("config") = wrap(trace_config), Named("iteration") = wrap(trace_iteration), 
+    Named("seconds") = wrap(trace_seconds), Named("loss") = wrap(trace_loss), Named("testing_loss") = wrap(trace_testing_loss)));
+  return List::create(Named("summary") = summary, Named("trace") = trace, Named("best") = static_cast<int>(best_id + 1), 
+    Named("model") = Rcpp::internal::make_new_object(best.release()));
 }
 // 
 // //[[Rcpp::export]]
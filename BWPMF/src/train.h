@@ -2,154 +2,306 @@
 #define __TRAIN_H__
 
 #include <memory>
-#include <boost/serialization/split_member.hpp>
-#include <boost/iostreams/stream.hpp>
-#include <boost/archive/binary_iarchive.hpp>
-#include <boost/archive/binary_oarchive.hpp>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <boost/format.hpp>
 #include <Rcpp.h>
 #include "bwpmf.h"
+#include "kernel.h"
+#include "phi_codec.h"
+#include "schedule.h"
 
-struct Phi {
-  
-  DTYPE *data;
-  
-  Phi() : data(new DTYPE[Param::K]) 
-  { }
-  
-  ~Phi() { delete [] data; }
-
-  template<class Archive>
-  void serialize(Archive &ar, const unsigned int version) const {
-    for(size_t i = 0;i < Param::K;i++) {
-      ar & data[i];
-    }
-  }
-
+// The layout of the file of a `PhiOnDisk` or an mmap `PhiList`.
+struct PhiOnDiskHeader {
+  uint64_t magic;
+  uint32_t K;
+  // the number of stored phi of a row, see `PhiCodec::row_size`
+  uint32_t row_size;
+  uint16_t codec;
+  uint16_t entry_size;
+  uint32_t reserved;
+  uint64_t count;
 };
 
+inline PhiOnDiskHeader make_phi_header(uint64_t magic, const PhiCodec& codec, int K, size_t count) {
+  PhiOnDiskHeader header = { magic, static_cast<uint32_t>(K), static_cast<uint32_t>(codec.row_size(K)), 
+    static_cast<uint16_t>(codec.type), static_cast<uint16_t>(codec.entry_size()), 0, count };
+  return header;
+}
+
+// The phi of the nonzeros visited by one thread, spilled to `path` in the
+// order they are written. The file is a `PhiOnDiskHeader` followed by the raw
+// `count` rows of phi encoded by the `PhiCodec`. It is written and read in
+// blocks of `buffer_bytes` by a background I/O thread with pwrite/pread, while
+// the compute thread works on another one of the `buffer_count` blocks: a full
+// block is drained while the next one is filled, and the next blocks are
+// prefetched while the current one is read. The time the compute thread waits
+// for a block is counted in `stall_seconds`. An I/O error inside a parallel
+// region cannot be thrown, so it is kept and reported by `check_error`.
 class PhiOnDisk {
   
+  static const uint64_t MAGIC = 0x3130444950465742ULL; // "BWFPID01"
+  
+  typedef std::chrono::steady_clock Clock;
+  
   enum Mode {
     read,
     write
   } mode;
   
+  struct Job {
+    Mode mode;
+    size_t buffer, row, rows;
+  };
+  
+  int K;
+  
+  PhiCodec codec;
+  
+  // the bytes of an encoded phi row
+  size_t row_bytes;
+  
+  // the number of phi in each buffer
   size_t buffer_size;
   
-  Phi *buffer;
+  std::vector<AlignedArray<unsigned char> > buffer;
   
-  std::string path;
+  // the number of valid phi in each buffer
+  std::vector<size_t> buffer_rows;
+  
+  // the buffer is owned by the I/O thread
+  std::vector<bool> busy;
+  
+  size_t current_buffer;
   
   size_t current_position;
   
   size_t total_size;
   
-  size_t read_size;
+  // the next row of the file to be written or requested
+  size_t next_row;
   
-  std::shared_ptr<std::ifstream> ifs;
+  std::string path;
   
-  std::shared_ptr<boost::archive::binary_iarchive> iar;
+  int fd;
   
-  std::shared_ptr<std::ofstream> ofs;
+  std::string error;
   
-  std::shared_ptr<boost::archive::binary_oarchive> oar;
+  double stall_seconds, io_seconds;
   
-  void flush() {
-    switch (mode) {
-    case Mode::read: {
-#ifdef NOISY_DDEBUG
-      Rcpp::Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
-#endif
-      size_t i = 0;
-      while(i < buffer_size & i + read_size < total_size) {
-        Phi& phi(buffer[i]);
-#ifdef NOISY_DDEBUG
-        Rprintf("%zu(total: %zu)\n", i, total_size);
-#endif
-        *iar >> phi;
-        i += 1;
+  size_t io_bytes;
+  
+  std::deque<Job> jobs;
+  
+  bool stop;
+  
+  std::mutex mutex;
+  
+  std::condition_variable job_ready, job_done;
+  
+  std::thread worker;
+  
+  PhiOnDisk(const PhiOnDisk&);
+  void operator=(const PhiOnDisk&);
+  
+  static std::string error_message(const std::string& msg, const std::string& path) {
+    return boost::str(boost::format("%1% (%2%): %3%") % msg % path % strerror(errno));
+  }
+  
+  // It must be called with the lock.
+  void set_error(const std::string& msg) {
+    if (error.size() == 0) error = msg;
+  }
+  
+  std::string pwrite_all(const void* src, size_t bytes, off_t offset) {
+    const char *p = static_cast<const char*>(src);
+    while(bytes > 0) {
+      ssize_t n = ::pwrite(fd, p, bytes, offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return error_message("pwrite failed", path);
       }
-      read_size += i;
-#ifdef NOISY_DDEBUG
-      Rcpp::Rcout << __FILE__ << "(" << __LINE__ << ") read_size: " << read_size <<  std::endl;
-#endif
-      return;
+      p += n;
+      offset += n;
+      bytes -= n;
     }
-    case Mode::write: {
-#ifdef NOISY_DDEBUG
-      Rcpp::Rcout << __FILE__ << "(" << __LINE__ << ")" << std::endl;
-      Rcpp::Rcout << "writing " << current_position << " elements to disk..." << std::endl;
-#endif
-      for(size_t i = 0;i < current_position;i++) {
-        Phi& phi(buffer[i]);
-        *oar << phi;
-        total_size++;
+    return "";
+  }
+  
+  std::string pread_all(void* dst, size_t bytes, off_t offset) {
+    char *p = static_cast<char*>(dst);
+    while(bytes > 0) {
+      ssize_t n = ::pread(fd, p, bytes, offset);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return error_message("pread failed", path);
       }
-#ifdef NOISY_DDEBUG
-      Rcpp::Rcout << __FILE__ << "(" << __LINE__ << ") total_size: " << total_size << std::endl;
-#endif
-      return;
+      if (n == 0) {
+        errno = EIO;
+        return error_message("unexpected end of file", path);
+      }
+      p += n;
+      offset += n;
+      bytes -= n;
     }
+    return "";
+  }
+  
+  off_t offset_of(size_t i) const {
+    return sizeof(PhiOnDiskHeader) + static_cast<off_t>(i) * row_bytes;
+  }
+  
+  // the loop of the I/O thread
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while(true) {
+      job_ready.wait(lock, [this]() { return stop | !jobs.empty(); });
+      if (jobs.empty()) return;
+      const Job job = jobs.front();
+      jobs.pop_front();
+      const bool failed = error.size() > 0;
+      lock.unlock();
+      std::string msg;
+      const Clock::time_point start = Clock::now();
+      const size_t bytes = job.rows * row_bytes;
+      if (!failed) {
+        if (job.mode == Mode::write) msg = pwrite_all(buffer[job.buffer].get(), bytes, offset_of(job.row));
+        else msg = pread_all(buffer[job.buffer].get(), bytes, offset_of(job.row));
+      }
+      const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+      lock.lock();
+      if (msg.size() > 0) set_error(msg);
+      io_seconds += elapsed;
+      io_bytes += bytes;
+      busy[job.buffer] = false;
+      job_done.notify_all();
     }
   }
   
-  void reset() {
-    current_position = 0;
+  void submit(Mode _mode, size_t b, size_t row, size_t rows) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      busy[b] = true;
+      Job job = { _mode, b, row, rows };
+      jobs.push_back(job);
+    }
+    job_ready.notify_one();
   }
   
-  void check() {
-    if (current_position == buffer_size) {
-      flush();
-      reset();
+  // waits until the I/O thread releases the buffer
+  void wait(size_t b) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!busy[b]) return;
+    const Clock::time_point start = Clock::now();
+    job_done.wait(lock, [this, b]() { return !busy[b]; });
+    stall_seconds += std::chrono::duration<double>(Clock::now() - start).count();
+  }
+  
+  void wait_all() {
+    for(size_t b = 0;b < buffer.size();b++) {
+      wait(b);
     }
   }
   
+  // prefetches the next block of the file into the buffer
+  void request(size_t b) {
+    const size_t rows = std::min(buffer_size, total_size - next_row);
+    buffer_rows[b] = rows;
+    if (rows > 0) submit(Mode::read, b, next_row, rows);
+    next_row += rows;
+  }
+  
+  void next_buffer() {
+    current_buffer = (current_buffer + 1) % buffer.size();
+    current_position = 0;
+    wait(current_buffer);
+  }
+  
   void start_write() {
+    wait_all();
     mode = Mode::write;
+    next_row = 0;
+    current_buffer = 0;
     current_position = 0;
-    total_size = 0;
-    ofs.reset(new std::ofstream(path.c_str()));
-    oar.reset(new boost::archive::binary_oarchive(*ofs));
-    reset();
   }
 
   void end_write() {
-    flush();
-    reset();
-    ofs->flush();
-    ofs->close();
-    oar.reset();
-    ofs.reset();
+    if (current_position > 0) submit(Mode::write, current_buffer, next_row, current_position);
+    next_row += current_position;
+    wait_all();
+    total_size = next_row;
+    current_position = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (error.size() > 0) return;
+    const PhiOnDiskHeader header = make_phi_header(MAGIC, codec, K, total_size);
+    set_error(pwrite_all(&header, sizeof(header), 0));
+    if (::ftruncate(fd, offset_of(total_size)) != 0) set_error(error_message("ftruncate failed", path));
   }
 
   void start_read() {
+    wait_all();
     mode = Mode::read;
-    ifs.reset(new std::ifstream(path.c_str()));
-    iar.reset(new boost::archive::binary_iarchive(*ifs));
-    read_size = 0;
-    flush();
-    reset();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const PhiOnDiskHeader expected = make_phi_header(MAGIC, codec, K, total_size);
+      PhiOnDiskHeader header;
+      const std::string msg(pread_all(&header, sizeof(header), 0));
+      set_error(msg);
+      if (msg.size() == 0 && std::memcmp(&header, &expected, sizeof(header)) != 0) {
+        errno = EINVAL;
+        set_error(error_message("invalid header of phi", path));
+      }
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    next_row = 0;
+    for(size_t b = 0;b < buffer.size();b++) {
+      request(b);
+    }
+    current_buffer = 0;
+    current_position = 0;
+    wait(current_buffer);
   }
   
   void end_read() {
-    reset();
-    ifs->close();
-    iar.reset();
-    ifs.reset();
+    wait_all();
+    current_position = 0;
   }
 
 public:
-  PhiOnDisk(const std::string _path, size_t _buffer_size = 10000) 
-    : buffer_size(_buffer_size), buffer(new Phi[buffer_size]), path(_path),
-      current_position(0), iar(NULL), oar(NULL), total_size(0), read_size(0)
+  PhiOnDisk(const std::string _path, int _K, size_t buffer_bytes = 1 << 24, int buffer_count = 2, PhiCodec _codec = PhiCodec()) 
+    : K(_K), codec(_codec), row_bytes(_codec.row_bytes(_K)), buffer_size(std::max<size_t>(1, buffer_bytes / row_bytes)), 
+      buffer(std::max(buffer_count, 2)), buffer_rows(buffer.size(), 0), busy(buffer.size(), false),
+      current_buffer(0), current_position(0), total_size(0), next_row(0), 
+      path(_path), fd(-1), error(), stall_seconds(0), io_seconds(0), io_bytes(0), 
+      jobs(), stop(false)
   {  
 #ifdef NOISY_DEBUG
-    Rcpp::Rcout << "PhiOnDisk with K: " << Param::K << std::endl;
+    Rcpp::Rcout << "PhiOnDisk with K: " << K << std::endl;
 #endif
+    for(auto& b : buffer) b.resize(buffer_size * row_bytes);
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error(error_message("Failed to open", path));
+    worker = std::thread(&PhiOnDisk::run, this);
   }
   
   ~PhiOnDisk() {
-    delete [] buffer;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    job_ready.notify_one();
+    worker.join();
+    ::close(fd);
   }
   
   struct WriteFlag {
@@ -180,27 +332,492 @@ public:
     return ReadFlag(*this);
   }
   
-  Phi& get_write_target() {
-    check();
-    Phi& retval(buffer[current_position++]);
-    return retval;
+  // the next encoded row, see `PhiCodec::target`
+  void* get_write_target() {
+    if (current_position == buffer_size) {
+      submit(Mode::write, current_buffer, next_row, buffer_size);
+      next_row += buffer_size;
+      next_buffer();
+    }
+    return buffer[current_buffer].get() + (current_position++) * row_bytes;
   }
   
-
-  const Phi& get_read_target() {
-    check();
-    const Phi& retval(buffer[current_position++]);
-    return retval;
+  // the next encoded row, see `PhiCodec::decode`
+  const void* get_read_target() {
+    if (current_position == buffer_rows[current_buffer]) {
+      request(current_buffer);
+      next_buffer();
+    }
+    return buffer[current_buffer].get() + (current_position++) * row_bytes;
   }
   
   const size_t get_total_size() const {
     return total_size;
   }
   
+  const int get_K() const {
+    return K;
+  }
+  
+  const PhiCodec& get_codec() const {
+    return codec;
+  }
+  
+  // the seconds that the compute thread waited for the I/O thread
+  const double get_stall_seconds() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stall_seconds;
+  }
+  
+  // the seconds that the I/O thread spent in pread/pwrite
+  const double get_io_seconds() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return io_seconds;
+  }
+  
+  const size_t get_io_bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return io_bytes;
+  }
+  
+  void reset_stats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    stall_seconds = 0;
+    io_seconds = 0;
+    io_bytes = 0;
+  }
+  
+  const bool has_error() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error.size() > 0;
+  }
+  
+  // Throws the first I/O error since the last call. It must be called outside
+  // of the parallel regions.
+  void check_error() {
+    std::string msg;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      msg.swap(error);
+    }
+    if (msg.size() > 0) throw std::runtime_error(msg);
+  }
+  
 };
 
-typedef ListOfList<Phi> PhiList;
+// The phi of every nonzero of a History in one `nnz x K` slab encoded by the 
+// `PhiCodec`. The rows follow the CSR order of `History.data`, so the phi of 
+// the j-th item of the user starts at the byte `(index[user] + j) * row_bytes`.
+// The slab is either on the heap or in a mapped file, and any thread can work
+// on any user in both cases.
+class PhiList {
+  
+  int K;
+  
+  PhiCodec codec;
+  
+  // the bytes of an encoded phi row
+  size_t row_bytes;
+  
+  size_t index_size;
+  
+  std::vector<size_t> index;
+  
+  // the storage of the heap
+  AlignedArray<unsigned char> heap;
+  
+  // the storage of the mapped file
+  void *map;
+  
+  size_t map_size;
+  
+  unsigned char *data;
+  
+  PhiList(const PhiList&);
+  void operator=(const PhiList&);
+  
+  template<typename T>
+  void init_index(const ListOfList<T>& src) {
+    for(size_t i = 0;i < index_size + 1;i++) {
+      index[i] = src.offset(i);
+    }
+  }
+
+public:
+  
+  static const uint64_t MAGIC = 0x3130504d46505742ULL; // "BWPFMP01"
+  
+  // The data starts at a page boundary after the header.
+  static const size_t HEADER_SIZE = 4096;
+  
+  template<typename T>
+  PhiList(const ListOfList<T>& src, int _K, PhiCodec _codec = PhiCodec())
+    : K(_K), codec(_codec), row_bytes(_codec.row_bytes(_K)), 
+      index_size(src.get_index_size()), index(src.get_index_size() + 1),
+      heap(src.get_total_size() * row_bytes), map(nullptr), map_size(0), data(heap.get())
+  {
+    init_index(src);
+    unsigned char *p = data;
+#pragma omp parallel for
+    for(size_t i = 0;i < index_size;i++) {
+      std::fill(p + index[i] * row_bytes, p + index[i + 1] * row_bytes, 0);
+    }
+  }
+  
+  // The phi is kept in a file of `path` which is mapped into the memory, so the 
+  // page cache of the kernel is the buffer. The file is reused if its header 
+  // matches K, the codec and the size of `src`.
+  template<typename T>
+  PhiList(const ListOfList<T>& src, int _K, const std::string& path, PhiCodec _codec = PhiCodec())
+    : K(_K), codec(_codec), row_bytes(_codec.row_bytes(_K)), 
+      index_size(src.get_index_size()), index(src.get_index_size() + 1),
+      heap(), map(nullptr), map_size(HEADER_SIZE + src.get_total_size() * row_bytes), data(nullptr)
+  {
+    init_index(src);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) throw std::runtime_error(boost::str(boost::format("Failed to open %1%: %2%") % path % strerror(errno)));
+    const PhiOnDiskHeader header = make_phi_header(MAGIC, codec, K, src.get_total_size());
+    PhiOnDiskHeader old_header;
+    const bool is_reused = ::pread(fd, &old_header, sizeof(old_header), 0) == sizeof(old_header) && 
+      std::memcmp(&header, &old_header, sizeof(header)) == 0;
+    // The blocks are reserved, also for a reused file which may be sparse, so a
+    // full disk fails here instead of a SIGBUS while the mapping is written.
+    int error = !is_reused && ::ftruncate(fd, 0) != 0 ? errno : 0;
+    if (error == 0) error = ::posix_fallocate(fd, 0, map_size);
+    if (error == EOPNOTSUPP) error = ::ftruncate(fd, map_size) != 0 ? errno : 0;
+    if (error == 0 & !is_reused) error = ::pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ? errno : 0;
+    if (error != 0) {
+      ::close(fd);
+      throw std::runtime_error(boost::str(boost::format("Failed to initialize %1%: %2%") % path % strerror(error)));
+    }
+    map = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    const std::string msg(strerror(errno));
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      map = nullptr;
+      throw std::runtime_error(boost::str(boost::format("Failed to map %1%: %2%") % path % msg));
+    }
+    data = static_cast<unsigned char*>(map) + HEADER_SIZE;
+  }
+  
+  ~PhiList() {
+    if (map != nullptr) ::munmap(map, map_size);
+  }
+  
+  const bool is_mapped() const {
+    return map != nullptr;
+  }
+  
+  // the first encoded row of the user
+  unsigned char* operator()(size_t i) {
+#ifdef CHECK_BOUNDARY
+    if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
+#endif
+    return data + index[i] * row_bytes;
+  }
+  
+  const unsigned char* operator()(size_t i) const {
+#ifdef CHECK_BOUNDARY
+    if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
+#endif
+    return data + index[i] * row_bytes;
+  }
+  
+  unsigned char* get_data() {
+    return data;
+  }
+  
+  const unsigned char* get_data() const {
+    return data;
+  }
+  
+  const int get_K() const {
+    return K;
+  }
+  
+  const PhiCodec& get_codec() const {
+    return codec;
+  }
+  
+  const size_t get_row_bytes() const {
+    return row_bytes;
+  }
+  
+  const size_t get_total_size() const {
+    return index[index_size];
+  }
+  
+  const size_t get_index_size() const {
+    return index_size;
+  }
+  
+  const size_t* get_index() const {
+    return &index[0];
+  }
+  
+  const size_t offset(size_t i) const {
+    return index[i];
+  }
+  
+  const size_t size(size_t i) const {
+#ifdef CHECK_BOUNDARY
+    if (i >= index_size) throw std::invalid_argument("i exceeds the index_size");
+#endif
+    return index[i + 1] - index[i];
+  }
+  
+};
 
 typedef std::vector<std::shared_ptr<PhiOnDisk> > pPhiOnDiskVec;
 
+// The state of the fused mode which never stores phi. Each phi is consumed as
+// soon as it is computed, so only the `item_size x K` accumulator of 
+// `sum_u y_{u,i} phi_{u,i}` is kept. It is cleared after the item update.
+struct PhiFused {
+  
+  int K;
+  
+  size_t item_size;
+  
+  AlignedArray<DTYPE> item_shp1;
+  
+  PhiFused(size_t _item_size, int _K) 
+    : K(_K), item_size(_item_size), item_shp1(_item_size * _K)
+  {
+    DTYPE *p = item_shp1.get();
+#pragma omp parallel for
+    for(size_t item = 0;item < item_size;item++) {
+      std::fill(p + item * K, p + (item + 1) * K, 0.0);
+    }
+  }
+  
+};
+
+// The number of bytes of the private item rows of each thread, see 
+// `ItemAccumulator`.
+#ifndef BWPMF_PRIVATE_BYTES
+#define BWPMF_PRIVATE_BYTES (1 << 24)
+#endif
+
+// How `sum_u y_{u,i} phi_{u,i}` is accumulated into the items:
+// - ITEM_UPDATE_ATOMIC: atomic adds while scanning the users.
+// - ITEM_UPDATE_PRIVATE: the items with the largest degree are accumulated in
+//   the private rows of each thread and merged afterward. Only the rest of the
+//   items, which are rarely hit at the same time, use atomic adds.
+// - ITEM_UPDATE_GATHER: each thread owns a disjoint set of items and gathers
+//   their phi through `ItemIndex`. It requires the phi in memory.
+// - ITEM_UPDATE_TILED: the nonzeros are scanned by the tiles of 
+//   `TileScheduler`, so the items of a tile stay in the cache and the threads
+//   never add to the same item at the same time. It requires the memory, mmap
+//   or fused storage.
+enum ItemUpdate {
+  ITEM_UPDATE_ATOMIC,
+  ITEM_UPDATE_PRIVATE,
+  ITEM_UPDATE_GATHER,
+  ITEM_UPDATE_TILED
+};
+
+ItemUpdate parse_item_update(const std::string& item_update);
+
+// Accumulates `y * phi` into an `item_size x K` slab shared by the threads. 
+// The `head_size` items with the largest degree have a private row in each 
+// thread and they are summed into the slab by `merge`.
+class ItemAccumulator {
+  
+  int K;
+  
+  // item -> row of the private buffers, or -1 if the item uses atomic adds
+  std::vector<int> slot;
+  
+  // row of the private buffers -> item
+  std::vector<size_t> head;
+  
+  std::vector<AlignedArray<DTYPE> > buffer;
+  
+public:
+  
+  // Every item uses atomic adds.
+  ItemAccumulator(size_t item_size, int _K, int threads)
+    : K(_K), slot(item_size, -1), head(), buffer(threads)
+    { }
+  
+  ItemAccumulator(const ItemIndex& item_index, int _K, size_t head_size, int threads)
+    : K(_K), slot(item_index.item_size, -1), head(item_index.item_size), buffer(threads)
+  {
+    for(size_t item = 0;item < head.size();item++) head[item] = item;
+    if (head_size < head.size()) {
+      std::nth_element(head.begin(), head.begin() + head_size, head.end(), [&item_index](size_t i, size_t j) {
+        return item_index.degree(i) > item_index.degree(j);
+      });
+      head.resize(head_size);
+    }
+    std::sort(head.begin(), head.end());
+    for(size_t i = 0;i < head.size();i++) slot[head[i]] = i;
+    for(auto& local_buffer : buffer) {
+      local_buffer.resize(head.size() * K);
+      std::fill(local_buffer.get(), local_buffer.get() + local_buffer.size(), 0.0);
+    }
+  }
+  
+  const size_t get_head_size() const {
+    return head.size();
+  }
+  
+  const int get_threads() const {
+    return buffer.size();
+  }
+  
+  // target[item * K + k] += y * phi[k]
+  template<int KS>
+  void add(int thread_id, size_t item, DTYPE y, const DTYPE* phi, DTYPE* target) {
+    const int i = slot[item];
+    if (i < 0) Kernel<KS>::atomic_axpy(y, phi, target + item * K, K);
+    else Kernel<KS>::axpy(y, phi, buffer[thread_id].get() + i * K, K);
+  }
+  
+  // target[item * K + k] += y * phi[k] of a stored row, see `PhiCodec::axpy`
+  template<int KS>
+  void add(int thread_id, size_t item, DTYPE y, const PhiCodec& codec, const void* row, DTYPE* phi_buffer, DTYPE* target) {
+    const int i = slot[item];
+    if (i < 0) codec.atomic_axpy<KS>(y, row, phi_buffer, target + item * K, K);
+    else codec.axpy<KS>(y, row, phi_buffer, buffer[thread_id].get() + i * K, K);
+  }
+  
+  // Adds the private rows into the target and clears them. This is an orphaned
+  // work-sharing loop and it must be called inside a parallel region.
+  void merge(DTYPE* target) {
+#pragma omp for
+    for(size_t i = 0;i < head.size();i++) {
+      DTYPE *dst = target + head[i] * K;
+      for(auto& local_buffer : buffer) {
+        DTYPE *src = local_buffer.get() + i * K;
+        for(int k = 0;k < K;k++) {
+          dst[k] += src[k];
+        }
+        std::fill(src, src + K, 0.0);
+      }
+    }
+  }
+  
+};
+
+// The posterior means E[theta] and E[beta] of a model as `size x K` slabs, and
+// their sums over the users and the items. The logloss is 
+// `sum_k(user_sum[k] * item_sum[k]) - sum y log(lambda)`, and with the slabs
+// the lambda of a nonzero is a dot product instead of 2K divisions.
+struct PosteriorMean {
+  
+  // the width of the rows, see `Kernel::width`
+  int K;
+  
+  AlignedArray<DTYPE> user, item;
+  
+  std::vector<double> user_sum, item_sum;
+  
+  // `sum y log(lambda)` added by the threads, see `TrainContext::lagged_loss`
+  double loglik;
+  
+  PosteriorMean() : K(0), user(), item(), user_sum(), item_sum(), loglik(0.0) { }
+  
+  // Computes the means of `model` and clears `loglik`. This is made of 
+  // orphaned work-sharing loops and it must be called inside a parallel region.
+  template<int KS>
+  void update(const Model& model) {
+#pragma omp single
+    {
+      K = Kernel<KS>::width(model.K);
+      user.resize(model.user_size * K);
+      item.resize(model.item_size * K);
+      user_sum.assign(K, 0.0);
+      item_sum.assign(K, 0.0);
+      loglik = 0.0;
+    }
+    std::vector<double> local_user_sum(K, 0.0), local_item_sum(K, 0.0);
+#pragma omp for nowait
+    for(size_t i = 0;i < model.user_size;i++) {
+      ConstParamView param(model.user_param[i]);
+      Kernel<KS>::posterior_mean(param.shp1, param.rte1, user.get() + i * K, &local_user_sum[0], K);
+    }
+#pragma omp for nowait
+    for(size_t i = 0;i < model.item_size;i++) {
+      ConstParamView param(model.item_param[i]);
+      Kernel<KS>::posterior_mean(param.shp1, param.rte1, item.get() + i * K, &local_item_sum[0], K);
+    }
+#pragma omp critical
+    for(int k = 0;k < K;k++) {
+      user_sum[k] += local_user_sum[k];
+      item_sum[k] += local_item_sum[k];
+    }
+#pragma omp barrier
+  }
+  
+  template<int KS>
+  const double lambda(size_t u, size_t i) const {
+    return Kernel<KS>::dot(user.get() + u * K, item.get() + i * K, K);
+  }
+  
+  // the logloss of `sum y log(lambda)` of the nonzeros
+  const double logloss(double _loglik) const {
+    double retval = -_loglik;
+    for(int k = 0;k < K;k++) {
+      retval += user_sum[k] * item_sum[k];
+    }
+    return retval;
+  }
+  
+};
+
+// The scratch buffers and the reduction state of the training of one model, 
+// kept by `Model::context`. Nothing of a training is shared with the others 
+// except the read-only history, so several models can be trained at the same
+// time by independent threads.
+struct TrainContext {
+  
+  // the width of the rows, see `Kernel::width`
+  int K;
+  
+  std::vector<double> user_sum, item_sum;
+  
+  AlignedArray<DTYPE> user_exp_elog, item_exp_elog;
+  
+  std::shared_ptr<ItemAccumulator> accumulator;
+  
+  // the users of the memory and fused storage, see `ChunkScheduler`
+  ChunkScheduler scheduler;
+  
+  // the nonzeros of the tiled item update
+  TileScheduler tiles;
+  
+  // If it is true, `iterate` also adds `sum y log(lambda)` of the parameters
+  // before the iteration to `mean.loglik` in its pass of phi, so the logloss
+  // is known one iteration later without another pass over the nonzeros.
+  bool lagged_loss;
+  
+  PosteriorMean mean;
+  
+  // the steps of the stochastic variational inference so far, see svi.cpp
+  size_t svi_steps;
+  
+  // the accumulator and the schedulers are reused while these are unchanged,
+  // see `History::generation`
+  uint64_t history_generation;
+  
+  ItemUpdate item_update;
+  
+  TrainContext() : K(0), user_sum(), item_sum(), user_exp_elog(), item_exp_elog(), 
+    accumulator(), scheduler(), tiles(), lagged_loss(false), mean(), svi_steps(0), history_generation(0), item_update(ITEM_UPDATE_ATOMIC)
+    { }
+  
+  // Resizes the buffers for the model and the threads of the caller. See 
+  // train.cpp.
+  void prepare(const Model& model, History& history, int K, ItemUpdate item_update);
+  
+};
+
+// The context of the model, which is created at the first call.
+inline TrainContext& get_train_context(Model& model) {
+  if (!model.context) model.context.reset(new TrainContext());
+  return *model.context;
+}
+
 #endif // __TRAIN_H__
\ No newline at end of file